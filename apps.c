@@ -1,6 +1,7 @@
 #include "apps.h"
-#include "jsonbuilderutils.h"
+#include "serialiser.h"
 #include "tbus.h"
+#include "http.h"
 
 static GPtrArray* apps;
 
@@ -71,6 +72,7 @@ gboolean apps_onappstateupdate(const struct apps_appstateupdate* update) {
 		g_message("updated connectivity status for %s", appstate->name);
 	}
 
+	http_onstatechange();
 	return TRUE;
 
 	err: //
@@ -82,6 +84,7 @@ void apps_onappdisconnected(guint index) {
 	if (appstate != NULL) {
 		g_message("app %s disconnected, clearing state", appstate->name);
 		memset(&appstate->state, 0, sizeof(appstate->state));
+		http_onstatechange();
 	}
 }
 
@@ -96,34 +99,34 @@ static const gchar* statestrings[] = { "UNKNOWN", "OK", "ERROR", "SEECODE" };
 
 static void apps_dumpapp(gpointer data, gpointer user_data) {
 	const struct apps_app* app = data;
-	JsonBuilder* builder = user_data;
-	json_builder_begin_object(builder);
-	JSONBUILDER_ADD_STRING(builder, FIELD_NAME, app->name);
+	struct serialiser* serialiser = user_data;
+	serialiser_beginobject(serialiser);
+	SERIALISER_ADD_STRING(serialiser, FIELD_NAME, app->name);
 
-	JSONBUILDER_START_OBJECT(builder, OBJECT_APPSTATE);
-	JSONBUILDER_ADD_STRING(builder, FIELD_STATE,
+	SERIALISER_START_OBJECT(serialiser, OBJECT_APPSTATE);
+	SERIALISER_ADD_STRING(serialiser, FIELD_STATE,
 			statestrings[MIN(app->state.appstate, G_N_ELEMENTS(statestrings))]);
-	JSONBUILDER_ADD_INT(builder, FIELD_CODE, app->state.appstate);
+	SERIALISER_ADD_INT(serialiser, FIELD_CODE, app->state.appstate);
 	if (app->state.appstate == THINGYMCCONFIG_ERR)
-		JSONBUILDER_ADD_INT(builder, FIELD_ERROR, app->state.appstate);
-	json_builder_end_object(builder);
+		SERIALISER_ADD_INT(serialiser, FIELD_ERROR, app->state.appstate);
+	serialiser_endobject(serialiser);
 
-	JSONBUILDER_START_OBJECT(builder, OBJECT_CONNECTIVITY);
-	JSONBUILDER_ADD_STRING(builder, FIELD_STATE,
+	SERIALISER_START_OBJECT(serialiser, OBJECT_CONNECTIVITY);
+	SERIALISER_ADD_STRING(serialiser, FIELD_STATE,
 			statestrings[MIN(app->state.connectivity, G_N_ELEMENTS(statestrings))]);
-	JSONBUILDER_ADD_INT(builder, FIELD_CODE, app->state.connectivity);
+	SERIALISER_ADD_INT(serialiser, FIELD_CODE, app->state.connectivity);
 	if (app->state.connectivity == THINGYMCCONFIG_ERR)
-		JSONBUILDER_ADD_INT(builder, FIELD_ERROR, app->state.connectivityerror);
-	json_builder_end_object(builder);
+		SERIALISER_ADD_INT(serialiser, FIELD_ERROR,
+				app->state.connectivityerror);
+	serialiser_endobject(serialiser);
 
-	json_builder_end_object(builder);
+	serialiser_endobject(serialiser);
 }
 
-void apps_dumpstatus(JsonBuilder* builder) {
-	json_builder_set_member_name(builder, "apps");
-	json_builder_begin_array(builder);
-	g_ptr_array_foreach(apps, apps_dumpapp, builder);
-	json_builder_end_array(builder);
+void apps_dumpstatus(struct serialiser* serialiser) {
+	SERIALISER_START_ARRAY(serialiser, "apps");
+	g_ptr_array_foreach(apps, apps_dumpapp, serialiser);
+	serialiser_endarray(serialiser);
 }
 
 gboolean apps_ctrl_sendconfig(GOutputStream* os) {
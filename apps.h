@@ -1,6 +1,7 @@
 #pragma once
 
-#include <json-glib/json-glib.h>
+#include <gio/gio.h>
+#include "serialiser.h"
 
 struct apps_appstateupdate {
 	unsigned char appindex;
@@ -13,5 +14,5 @@ struct apps_appstateupdate {
 void apps_init(const gchar** appnames);
 gboolean apps_onappstateupdate(const struct apps_appstateupdate* update);
 void apps_onappdisconnected(guint index);
-void apps_dumpstatus(JsonBuilder* builder);
+void apps_dumpstatus(struct serialiser* serialiser);
 gboolean apps_ctrl_sendconfig(GOutputStream* os);
@@ -4,6 +4,8 @@
 // networking stuff
 #define ARGS_INTERFACE        {"interface", 'i', 0, G_OPTION_ARG_STRING, &interface, "interface", NULL}
 #define ARGS_WAITFORINTERFACE {"waitforinterface", 'w', 0, G_OPTION_ARG_NONE, &waitforinterface, "wait for interface to appear", NULL}
+#define ARGS_SCANINTERVAL     {"scaninterval", 's', 0, G_OPTION_ARG_INT, &scaninterval, "minimum number of seconds between scans", NULL}
+#define ARGS_SINGLESUPPLICANT {"singlesupplicant", 'S', 0, G_OPTION_ARG_NONE, &singlesupplicant, "run one wpa_supplicant for both interfaces", NULL}
 // apps
 #define ARGS_APP              {"app", 'a', 0, G_OPTION_ARG_STRING_ARRAY, &apps, "register an app", NULL}
 // crypto options
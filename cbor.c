@@ -0,0 +1,96 @@
+/* Just enough of CBOR (RFC 7049) to encode what would otherwise be sent
+ * as JSON. Everything is encoded with the shortest head possible.
+ */
+
+#include <string.h>
+
+#include "cbor.h"
+
+#define CBOR_MAJOR_UINT		0
+#define CBOR_MAJOR_NEGINT	1
+#define CBOR_MAJOR_TEXT		3
+#define CBOR_MAJOR_ARRAY	4
+#define CBOR_MAJOR_MAP		5
+#define CBOR_MAJOR_SIMPLE	7
+
+#define CBOR_AI_UINT8		24
+#define CBOR_AI_UINT16		25
+#define CBOR_AI_UINT32		26
+#define CBOR_AI_UINT64		27
+#define CBOR_AI_INDEFINITE	31
+
+#define CBOR_SIMPLE_FALSE	20
+#define CBOR_SIMPLE_TRUE	21
+#define CBOR_SIMPLE_NULL	22
+
+static void cbor_writehead(GByteArray* buf, guint8 major, guint64 value) {
+	guint8 head[9];
+	gsize headlen;
+	major <<= 5;
+	if (value < CBOR_AI_UINT8) {
+		head[0] = major | value;
+		headlen = 1;
+	} else if (value <= G_MAXUINT8) {
+		head[0] = major | CBOR_AI_UINT8;
+		head[1] = value;
+		headlen = 2;
+	} else if (value <= G_MAXUINT16) {
+		head[0] = major | CBOR_AI_UINT16;
+		guint16 be = GUINT16_TO_BE(value);
+		memcpy(&head[1], &be, sizeof(be));
+		headlen = 1 + sizeof(be);
+	} else if (value <= G_MAXUINT32) {
+		head[0] = major | CBOR_AI_UINT32;
+		guint32 be = GUINT32_TO_BE(value);
+		memcpy(&head[1], &be, sizeof(be));
+		headlen = 1 + sizeof(be);
+	} else {
+		head[0] = major | CBOR_AI_UINT64;
+		guint64 be = GUINT64_TO_BE(value);
+		memcpy(&head[1], &be, sizeof(be));
+		headlen = 1 + sizeof(be);
+	}
+	g_byte_array_append(buf, head, headlen);
+}
+
+void cbor_writeint(GByteArray* buf, gint64 value) {
+	if (value >= 0)
+		cbor_writehead(buf, CBOR_MAJOR_UINT, value);
+	else
+		// negative ints are encoded as -1 - n
+		cbor_writehead(buf, CBOR_MAJOR_NEGINT, -1 - value);
+}
+
+void cbor_writetext(GByteArray* buf, const gchar* text, gsize len) {
+	cbor_writehead(buf, CBOR_MAJOR_TEXT, len);
+	g_byte_array_append(buf, (const guint8*) text, len);
+}
+
+void cbor_writebool(GByteArray* buf, gboolean value) {
+	cbor_writehead(buf, CBOR_MAJOR_SIMPLE,
+			value ? CBOR_SIMPLE_TRUE : CBOR_SIMPLE_FALSE);
+}
+
+void cbor_writenull(GByteArray* buf) {
+	cbor_writehead(buf, CBOR_MAJOR_SIMPLE, CBOR_SIMPLE_NULL);
+}
+
+/* containers are written with an indefinite length so they can be
+ * streamed out without knowing how many things will be in them.
+ */
+static void cbor_writeindefinite(GByteArray* buf, guint8 major) {
+	guint8 head = (major << 5) | CBOR_AI_INDEFINITE;
+	g_byte_array_append(buf, &head, sizeof(head));
+}
+
+void cbor_writeindefinitearray(GByteArray* buf) {
+	cbor_writeindefinite(buf, CBOR_MAJOR_ARRAY);
+}
+
+void cbor_writeindefinitemap(GByteArray* buf) {
+	cbor_writeindefinite(buf, CBOR_MAJOR_MAP);
+}
+
+void cbor_writebreak(GByteArray* buf) {
+	cbor_writeindefinite(buf, CBOR_MAJOR_SIMPLE);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <glib.h>
+
+#define CBOR_CONTENTTYPE "application/cbor"
+
+void cbor_writeint(GByteArray* buf, gint64 value);
+void cbor_writetext(GByteArray* buf, const gchar* text, gsize len);
+void cbor_writebool(GByteArray* buf, gboolean value);
+void cbor_writenull(GByteArray* buf);
+void cbor_writeindefinitearray(GByteArray* buf);
+void cbor_writeindefinitemap(GByteArray* buf);
+void cbor_writebreak(GByteArray* buf);
@@ -1,2 +1,33 @@
 #include "certs.h"
 
+gboolean certs_load(struct certs* certs, const gchar* certpath,
+		const gchar* keypath) {
+	if (!g_file_get_contents(certpath, &certs->cert, NULL, NULL)) {
+		g_message("failed to load certificate from %s", certpath);
+		goto err_cert;
+	}
+
+	if (!g_file_get_contents(keypath, &certs->key, NULL, NULL)) {
+		g_message("failed to load private key from %s", keypath);
+		goto err_key;
+	}
+
+	return TRUE;
+
+	err_key: //
+	g_free(certs->cert);
+	certs->cert = NULL;
+	err_cert: //
+	return FALSE;
+}
+
+void certs_free(struct certs* certs) {
+	g_free(certs->cert);
+	certs->cert = NULL;
+	if (certs->key != NULL) {
+		// don't leave the key lying around in memory
+		memset(certs->key, 0, strlen(certs->key));
+		g_free(certs->key);
+		certs->key = NULL;
+	}
+}
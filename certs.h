@@ -1 +1,13 @@
 #pragma once
+
+#include <glib.h>
+#include <string.h>
+
+struct certs {
+	gchar* cert;
+	gchar* key;
+};
+
+gboolean certs_load(struct certs* certs, const gchar* certpath,
+		const gchar* keypath);
+void certs_free(struct certs* certs);
@@ -1,6 +1,6 @@
+#include <string.h>
 #include <json-glib/json-glib.h>
 #include "config.h"
-#include "jsonbuilderutils.h"
 
 static const char* cfgpath;
 static struct config* cfg = NULL;
@@ -8,19 +8,19 @@ static struct config* cfg = NULL;
 #define NETWORKCONFIG "network_config"
 
 static void config_save() {
-	JsonBuilder* jsonbuilder = json_builder_new();
-	json_builder_begin_object(jsonbuilder);
+	GByteArray* buf = g_byte_array_new();
+	struct serialiser serialiser;
+	serialiser_init(&serialiser, buf, SERIALISER_FORMAT_JSON);
+	serialiser_beginobject(&serialiser);
 
 	if (cfg->ntwkcfg != NULL) {
-		json_builder_set_member_name(jsonbuilder, NETWORKCONFIG);
-		network_model_config_serialise(cfg->ntwkcfg, jsonbuilder);
-		json_builder_end_object(jsonbuilder);
+		serialiser_member(&serialiser, NETWORKCONFIG);
+		network_model_config_serialise(cfg->ntwkcfg, &serialiser);
 	}
 
-	gsize jsonsz;
-	gchar* json = jsonbuilder_freetostring(jsonbuilder, &jsonsz, FALSE);
-	g_file_set_contents(cfgpath, json, jsonsz, NULL);
-	g_free(json);
+	serialiser_endobject(&serialiser);
+	g_file_set_contents(cfgpath, (const gchar*) buf->data, buf->len, NULL);
+	g_byte_array_unref(buf);
 }
 
 void config_init(const gchar* configpath) {
@@ -45,6 +45,11 @@ void config_init(const gchar* configpath) {
 		}
 		g_free(cfgjson);
 	}
+
+	// don't keep the passphrase from older configs around
+	if (cfg->ntwkcfg != NULL && !cfg->ntwkcfg->haspmk
+			&& network_model_config_derivepmk(cfg->ntwkcfg))
+		config_save();
 }
 
 void config_onnetworkconfigured(struct network_config* config) {
@@ -52,6 +57,21 @@ void config_onnetworkconfigured(struct network_config* config) {
 	config_save();
 }
 
+/* Only written when the bss has changed so a device that always comes
+ * back to the same AP doesn't write to flash on every boot.
+ */
+void config_onnetworkconnected(const gchar* bssid, int frequency) {
+	struct network_config* ntwkcfg = cfg->ntwkcfg;
+	if (ntwkcfg == NULL)
+		return;
+	if (ntwkcfg->lastfrequency == frequency
+			&& strcmp(ntwkcfg->lastbssid, bssid) == 0)
+		return;
+	g_strlcpy(ntwkcfg->lastbssid, bssid, sizeof(ntwkcfg->lastbssid));
+	ntwkcfg->lastfrequency = frequency;
+	config_save();
+}
+
 const struct config* config_getconfig() {
 	return cfg;
 }
@@ -8,4 +8,5 @@ struct config {
 
 void config_init(const gchar* configpath);
 void config_onnetworkconfigured(struct network_config* config);
+void config_onnetworkconnected(const gchar* bssid, int frequency);
 const struct config* config_getconfig(void);
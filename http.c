@@ -1,14 +1,46 @@
 #include <microhttpd.h>
-#include <json-glib/json-glib.h>
+#include <gio/gio.h>
+#include <gnutls/gnutls.h>
 #include <string.h>
 #include "http.h"
 #include "network.h"
 #include "utils.h"
 #include "apps.h"
-#include "jsonbuilderutils.h"
+#include "cbor.h"
+#include "serialiser.h"
 
-struct postconninfo {
-	GByteArray* payload;
+/* a rendered body and a strong etag for it so clients that already
+ * have it can be sent a 304 instead.
+ */
+struct cachedbody {
+	GBytes* body;
+	gchar* etag;
+};
+
+/* latencies are bucketed by power of two microseconds, so the
+ * percentiles are only accurate to within a factor of two but
+ * recording a request is just a few increments.
+ */
+#define LATENCY_BUCKETS 32
+
+struct latencyhistogram {
+	guint64 count;
+	guint64 bytes;
+	gint64 max;
+	guint64 buckets[LATENCY_BUCKETS];
+};
+
+struct conninfo {
+	struct latencyhistogram* histogram;
+	gint64 started;
+	gsize bytes;
+	struct network_model_configparser* configparser;
+	gsize uploaded;
+	gboolean rejected;
+	// what to answer with once the rest of a rejected post has arrived
+	unsigned int rejectstatus;
+	GBytes* body;
+	gboolean scanwaiting;
 };
 
 #define PORT 1338
@@ -17,204 +49,1074 @@ struct postconninfo {
 #define ENDPOINT_CONFIG "/config"
 #define ENDPOINT_STATUS "/status"
 #define ENDPOINT_DEBUG "/debug"
+#define ENDPOINT_EVENTS "/events"
+#define ENDPOINT_UI "/"
+
+#define UI_RESOURCE "/thingymcconfig/ui/index.html"
+#define UI_CONTENTTYPE "text/html; charset=utf-8"
+// the etag catches the ui changing with a firmware update
+#define UI_CACHECONTROL "public, max-age=86400"
+
+#define JSON_CONTENTTYPE "application/json"
+#define CONFIG_CONTENTTYPE JSON_CONTENTTYPE
+// the config is tiny, anything bigger than this is junk
+#define CONFIG_MAXBODY 1024
+
+#define SCAN_ARG_MAXAGE "maxage"
+#define SCAN_ARG_MINRSSI "minrssi"
+#define SCAN_ARG_BAND "band"
+#define SCAN_ARG_DEDUPE "dedupe"
+#define SCAN_ARG_LIMIT "limit"
+#define SCAN_BAND_24GHZ "2.4"
+#define SCAN_BAND_5GHZ "5"
+#define SCAN_DEDUPE_SSID "ssid"
+// how long a request will be parked waiting for scan results
+#define SCAN_WAITTIMEOUT 15
 
+/* idle keep-alive connections are closed after this many seconds, short
+ * enough that a client that has gone quiet doesn't sit on a slot.
+ */
+#define CONNECTION_TIMEOUT 10
+/* mhd counts every connection against the limit, event clients hold theirs
+ * for good so they get a share of their own and the rest is left for
+ * everything else, parked scans included.
+ */
+#define CONNECTION_LIMIT 16
+#define EVENTS_MAXCLIENTS 4
+
+#define EVENTS_BLOCKSIZE 1024
+// a comment is sent this often to find event clients that have gone away
+#define EVENTS_KEEPALIVE 30
+
+/* mhd doesn't get a thread of it's own, it's epoll fd is watched from
+ * the main loop so the handlers run alongside everything else and
+ * can look at the network state without any locking.
+ */
 static struct MHD_Daemon* mhd = NULL;
+static guint mhdwatch = 0;
+static guint mhdtimeout = 0;
+static guint mhdkick = 0;
 
-static int http_handleconnection_debug(struct MHD_Connection* connection) {
-	JsonBuilder* jsonbuilder = json_builder_new();
-	json_builder_begin_object(jsonbuilder);
-	json_builder_end_object(jsonbuilder);
+/* bumped whenever something that shows up in /status changes, the
+ * cached status body is only rebuilt when this moves.
+ */
+static gint stategeneration = 1;
+/* status and scan results can be sent as CBOR instead of JSON to clients
+ * that ask for it, each format has it's own cached body.
+ */
+enum bodyformat {
+	BODYFORMAT_JSON = SERIALISER_FORMAT_JSON,
+	BODYFORMAT_CBOR = SERIALISER_FORMAT_CBOR,
+	BODYFORMAT_NUM
+};
 
-	gsize contentln;
-	char* content = jsonbuilder_freetostring(jsonbuilder, &contentln, FALSE);
+/* The ui is compressed at build time and served straight out of the
+ * resource data so each encoding gets a body up front.
+ */
+enum uiencoding {
+	UIENCODING_IDENTITY, UIENCODING_GZIP, UIENCODING_BROTLI, UIENCODING_NUM
+};
 
-	int ret = 0;
-	struct MHD_Response* response = MHD_create_response_from_buffer(contentln,
-			(void*) content, MHD_RESPMEM_MUST_COPY);
-	if (response) {
-		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-		MHD_destroy_response(response);
-	} else
-		g_message("failed to create response");
+static const gchar* uiencodingsuffixes[] = { [UIENCODING_IDENTITY] = "",
+		[UIENCODING_GZIP] = ".gz", [UIENCODING_BROTLI] = ".br" };
+static const gchar* uiencodingnames[] = { [UIENCODING_IDENTITY] = "identity",
+		[UIENCODING_GZIP] = "gzip", [UIENCODING_BROTLI] = "br" };
 
-	g_free(content);
-	return ret;
+static struct cachedbody uibody[UIENCODING_NUM] = { { 0 } };
+
+// bodies are rendered into this and then copied out at their final size
+static GByteArray* renderbuf = NULL;
+
+static const gchar* bodyformatcontenttypes[] = {
+		[BODYFORMAT_JSON] = JSON_CONTENTTYPE,
+		[BODYFORMAT_CBOR] = CBOR_CONTENTTYPE };
+
+static struct cachedbody statusbody[BODYFORMAT_NUM] = { { 0 } };
+static gint statusbodygeneration[BODYFORMAT_NUM] = { 0 };
+
+/* rendered when new scan results arrive and then shared by every
+ * request until the next scan completes.
+ */
+static struct cachedbody scanbody[BODYFORMAT_NUM] = { { 0 } };
+static gint64 scanbodytime;
+// the results the body was rendered from, for requests that filter them
+static GArray* scanresultscache = NULL;
+
+enum scanband {
+	SCANBAND_ANY, SCANBAND_24GHZ, SCANBAND_5GHZ
+};
+
+struct scanfilter {
+	gboolean active;
+	gboolean hasminrssi;
+	gint minrssi;
+	enum scanband band;
+	gboolean dedupessid;
+	guint limit;
+};
+// connections that are suspended until the next scan results arrive
+static GSList* scanwaiters = NULL;
+static guint scanwaittimeout = 0;
+
+/* clients connected to the event stream, these are suspended while there
+ * is nothing to send them and resumed when a new event is queued.
+ */
+struct eventclient {
+	struct MHD_Connection* connection;
+	GString* pending;
+	gboolean suspended;
+};
+
+static GSList* eventclients = NULL;
+static gboolean eventsstopping = FALSE;
+static guint eventsidle = 0;
+static guint eventskeepalive = 0;
+
+/* With TLS every connection gets session tickets issued with a key that
+ * lives as long as the daemon so clients that reconnect can resume their
+ * session instead of doing a full handshake. Keep-alive is used so that
+ * polling clients don't need to reconnect at all.
+ */
+struct tlsconninfo {
+	gint64 accepted;
+	gboolean handshaken;
+};
+
+static gboolean tls = FALSE;
+static gnutls_datum_t ticketkey = { 0 };
+static struct latencyhistogram statushistogram = { 0 };
+static struct latencyhistogram scanhistogram = { 0 };
+static struct latencyhistogram confighistogram = { 0 };
+
+static guint64 tlshandshakes = 0;
+static guint64 tlsresumed = 0;
+static guint64 tlsrequests = 0;
+static gint64 tlshandshaketime = 0;
+static gint64 tlsmaxhandshaketime = 0;
+
+static void http_run(void);
+
+static gboolean http_ontimeout(gpointer user_data) {
+	mhdtimeout = 0;
+	http_run();
+	return FALSE;
 }
 
-static int http_handleconnection_status(struct MHD_Connection* connection) {
-	JsonBuilder* jsonbuilder = json_builder_new();
-	json_builder_begin_object(jsonbuilder);
-	network_dumpstatus(jsonbuilder);
-	apps_dumpstatus(jsonbuilder);
-	json_builder_end_object(jsonbuilder);
+static gboolean http_onkick(gpointer user_data) {
+	mhdkick = 0;
+	http_run();
+	return FALSE;
+}
 
-	gsize contentln;
-	char* content = jsonbuilder_freetostring(jsonbuilder, &contentln, FALSE);
+static gboolean http_onepollfd(GIOChannel *source, GIOCondition condition,
+		gpointer data) {
+	http_run();
+	return TRUE;
+}
 
-	int ret = 0;
-	struct MHD_Response* response = MHD_create_response_from_buffer(contentln,
-			(void*) content, MHD_RESPMEM_MUST_COPY);
-	if (response) {
-		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-		MHD_destroy_response(response);
-	} else
-		g_message("failed to create response");
+static void http_run() {
+	MHD_run(mhd);
 
-	g_free(content);
-	return ret;
+	if (mhdtimeout != 0) {
+		g_source_remove(mhdtimeout);
+		mhdtimeout = 0;
+	}
+	MHD_UNSIGNED_LONG_LONG timeout;
+	if (MHD_get_timeout(mhd, &timeout) == MHD_YES)
+		mhdtimeout = g_timeout_add(MIN(timeout, G_MAXUINT), http_ontimeout,
+		NULL);
 }
 
-static void http_handleconnection_scan_addscanresult(gpointer data,
-		gpointer userdata) {
+/* connections that have been resumed from outside of a handler are only
+ * picked up on the next run so make sure there is one.
+ */
+static void http_kick(void) {
+	if (mhdkick == 0)
+		mhdkick = g_idle_add(http_onkick, NULL);
+}
 
-	struct network_scanresult* scanresult = (struct network_scanresult*) data;
-	JsonBuilder* jsonbuilder = (JsonBuilder*) userdata;
+static struct conninfo* http_getconninfo(void** con_cls) {
+	if (*con_cls == NULL)
+		*con_cls = g_malloc0(sizeof(struct conninfo));
+	return *con_cls;
+}
+
+static void http_histogram_record(struct latencyhistogram* histogram,
+		gint64 latency, gsize bytes) {
+	guint bucket = MIN(g_bit_storage(latency), LATENCY_BUCKETS - 1);
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->bytes += bytes;
+	histogram->max = MAX(histogram->max, latency);
+}
+
+// returns the upper bound of the bucket the percentile falls into
+static gint64 http_histogram_percentile(
+		const struct latencyhistogram* histogram, guint percentile) {
+	if (histogram->count == 0)
+		return 0;
+	guint64 target = ((histogram->count * percentile) + 99) / 100;
+	guint64 seen = 0;
+	for (guint i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= target)
+			return MIN((((gint64) 1) << i) - 1, histogram->max);
+	}
+	return histogram->max;
+}
 
-	json_builder_begin_object(jsonbuilder);
-	json_builder_set_member_name(jsonbuilder, "bssid");
-	json_builder_add_string_value(jsonbuilder, scanresult->bssid);
-	json_builder_set_member_name(jsonbuilder, "frequency");
-	json_builder_add_int_value(jsonbuilder, scanresult->frequency);
-	json_builder_set_member_name(jsonbuilder, "rssi");
-	json_builder_add_int_value(jsonbuilder, scanresult->rssi);
-	json_builder_set_member_name(jsonbuilder, "ssid");
-	json_builder_add_string_value(jsonbuilder, scanresult->ssid);
-	json_builder_end_object(jsonbuilder);
+static void http_histogram_add(struct serialiser* serialiser,
+		const gchar* name, const struct latencyhistogram* histogram) {
+	SERIALISER_START_OBJECT(serialiser, name);
+	SERIALISER_ADD_INT(serialiser, "count", histogram->count);
+	SERIALISER_ADD_INT(serialiser, "p50_us",
+			http_histogram_percentile(histogram, 50));
+	SERIALISER_ADD_INT(serialiser, "p99_us",
+			http_histogram_percentile(histogram, 99));
+	SERIALISER_ADD_INT(serialiser, "max_us", histogram->max);
+	SERIALISER_ADD_INT(serialiser, "bytes", histogram->bytes);
+	serialiser_endobject(serialiser);
 }
 
-static int http_handleconnection_scan(struct MHD_Connection* connection) {
+/* the clock starts on the first call for a request and stops when mhd
+ * tells us the request is done, so time spent parked or pushing the
+ * response out to a slow client is included.
+ */
+static void http_startrequest(void** con_cls,
+		struct latencyhistogram* histogram) {
+	if (*con_cls != NULL)
+		return;
+	struct conninfo* con_info = http_getconninfo(con_cls);
+	con_info->histogram = histogram;
+	con_info->started = g_get_monotonic_time();
+}
+
+static void http_cachedbody_clear(struct cachedbody* cached) {
+	if (cached->body != NULL) {
+		g_bytes_unref(cached->body);
+		cached->body = NULL;
+	}
+	g_free(cached->etag);
+	cached->etag = NULL;
+}
+
+static void http_cachedbody_set(struct cachedbody* cached, GBytes* body) {
+	http_cachedbody_clear(cached);
+	cached->body = body;
+	gchar* checksum = g_compute_checksum_for_bytes(G_CHECKSUM_MD5, body);
+	cached->etag = g_strdup_printf("\"%s\"", checksum);
+	g_free(checksum);
+}
+
+static gboolean http_etagmatches(struct MHD_Connection* connection,
+		const gchar* etag) {
+	const char* ifnonematch = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+	if (ifnonematch == NULL)
+		return FALSE;
+
+	gboolean matches = FALSE;
+	gchar** etags = g_strsplit(ifnonematch, ",", -1);
+	for (gchar** e = etags; *e != NULL && !matches; e++) {
+		gchar* candidate = g_strstrip(*e);
+		// if-none-match uses the weak comparison
+		if (g_str_has_prefix(candidate, "W/"))
+			candidate += 2;
+		matches = (strcmp(candidate, "*") == 0)
+				|| (strcmp(candidate, etag) == 0);
+	}
+	g_strfreev(etags);
+	return matches;
+}
+
+static struct MHD_Response* http_createbodyresponse(void** con_cls,
+		GBytes* body) {
+	struct conninfo* con_info = http_getconninfo(con_cls);
+	gsize bodylen;
+	gconstpointer data = g_bytes_get_data(body, &bodylen);
+	struct MHD_Response* response = MHD_create_response_from_buffer(bodylen,
+			(void*) data, MHD_RESPMEM_PERSISTENT);
+	// the response borrows the body so hold a ref until the request is done
+	if (response) {
+		con_info->body = g_bytes_ref(body);
+		con_info->bytes = bodylen;
+	}
+	return response;
+}
+
+static int http_queueresponse(struct MHD_Connection* connection,
+		unsigned int status, struct MHD_Response* response) {
 	int ret = MHD_NO;
-	GPtrArray* scanresults = network_scan();
-	JsonBuilder* jsonbuilder = json_builder_new();
-	json_builder_begin_object(jsonbuilder);
-	json_builder_set_member_name(jsonbuilder, "scanresults");
-	json_builder_begin_array(jsonbuilder);
-	g_ptr_array_foreach(scanresults, http_handleconnection_scan_addscanresult,
-			jsonbuilder);
-	json_builder_end_array(jsonbuilder);
-	json_builder_end_object(jsonbuilder);
-
-	gsize jsonlen;
-	char* content = jsonbuilder_freetostring(jsonbuilder, &jsonlen, FALSE);
-	struct MHD_Response* response = MHD_create_response_from_buffer(jsonlen,
-			(void*) content, MHD_RESPMEM_MUST_COPY);
 	if (response) {
-		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+		ret = MHD_queue_response(connection, status, response);
 		MHD_destroy_response(response);
 	} else
 		g_message("failed to create response");
-	g_free(content);
 	return ret;
 }
 
-static int http_handleconnection_invalid(struct MHD_Connection* connection) {
+/* creates a response for a cached body, if the client already has the
+ * current version this will be an empty 304 instead.
+ */
+static struct MHD_Response* http_createcachedresponse(
+		struct MHD_Connection* connection, void** con_cls,
+		const struct cachedbody* cached, const gchar* contenttype,
+		const gchar* vary, unsigned int* status) {
+	struct MHD_Response* response;
+	if (http_etagmatches(connection, cached->etag)) {
+		response = MHD_create_response_from_buffer(0, NULL,
+				MHD_RESPMEM_PERSISTENT);
+		*status = MHD_HTTP_NOT_MODIFIED;
+	} else {
+		response = http_createbodyresponse(con_cls, cached->body);
+		*status = MHD_HTTP_OK;
+	}
+	if (response) {
+		MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, cached->etag);
+		MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+				contenttype);
+		MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, vary);
+	}
+	return response;
+}
+
+/* JSON is the default, CBOR is only used if the client asks for it at
+ * least as strongly as anything that would get JSON.
+ */
+static enum bodyformat http_negotiateformat(
+		struct MHD_Connection* connection) {
+	const char* accept = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT);
+	if (accept == NULL)
+		return BODYFORMAT_JSON;
+
+	gdouble jsonq = 0, cborq = 0;
+	gchar** ranges = g_strsplit(accept, ",", -1);
+	for (gchar** range = ranges; *range != NULL; range++) {
+		gchar** params = g_strsplit(*range, ";", -1);
+		if (params[0] == NULL)
+			goto next;
+		gchar* type = g_strstrip(params[0]);
+		gdouble q = 1;
+		for (gchar** param = params + 1; *param != NULL; param++) {
+			gchar* p = g_strstrip(*param);
+			if (g_ascii_strncasecmp(p, "q=", 2) == 0)
+				q = g_ascii_strtod(p + 2, NULL);
+		}
+		if (g_ascii_strcasecmp(type, CBOR_CONTENTTYPE) == 0)
+			cborq = MAX(cborq, q);
+		else if (g_ascii_strcasecmp(type, JSON_CONTENTTYPE) == 0
+				|| g_ascii_strcasecmp(type, "application/*") == 0
+				|| strcmp(type, "*/*") == 0)
+			jsonq = MAX(jsonq, q);
+		next: //
+		g_strfreev(params);
+	}
+	g_strfreev(ranges);
+
+	return (cborq > 0 && cborq >= jsonq) ? BODYFORMAT_CBOR : BODYFORMAT_JSON;
+}
+
+static void http_startbody(struct serialiser* serialiser,
+		enum bodyformat format) {
+	serialiser_init(serialiser, renderbuf, (enum serialiser_format) format);
+}
+
+static GBytes* http_finishbody(struct serialiser* serialiser) {
+	return g_bytes_new(serialiser->buf->data, serialiser->buf->len);
+}
+
+// for one off responses that don't need to outlive the render buffer
+static struct MHD_Response* http_createrenderedresponse(
+		struct serialiser* serialiser) {
+	return MHD_create_response_from_buffer(serialiser->buf->len,
+			serialiser->buf->data, MHD_RESPMEM_MUST_COPY);
+}
+
+static int http_handleconnection_debug(struct MHD_Connection* connection) {
+	struct serialiser serialiser;
+	http_startbody(&serialiser, BODYFORMAT_JSON);
+	serialiser_beginobject(&serialiser);
+	SERIALISER_START_OBJECT(&serialiser, "latency");
+	http_histogram_add(&serialiser, "status", &statushistogram);
+	http_histogram_add(&serialiser, "scan", &scanhistogram);
+	http_histogram_add(&serialiser, "config", &confighistogram);
+	serialiser_endobject(&serialiser);
+	if (tls) {
+		SERIALISER_START_OBJECT(&serialiser, "tls");
+		SERIALISER_ADD_INT(&serialiser, "handshakes", tlshandshakes);
+		SERIALISER_ADD_INT(&serialiser, "resumed", tlsresumed);
+		SERIALISER_ADD_INT(&serialiser, "requests", tlsrequests);
+		SERIALISER_ADD_INT(&serialiser, "handshake_avg_us",
+				tlshandshakes > 0 ? tlshandshaketime / tlshandshakes : 0);
+		SERIALISER_ADD_INT(&serialiser, "handshake_max_us",
+				tlsmaxhandshaketime);
+		serialiser_endobject(&serialiser);
+	}
+	network_dumpdebug(&serialiser);
+	serialiser_endobject(&serialiser);
+
+	return http_queueresponse(connection, MHD_HTTP_OK,
+			http_createrenderedresponse(&serialiser));
+}
+
+static GBytes* http_renderstatus(enum bodyformat format) {
+	struct serialiser serialiser;
+	http_startbody(&serialiser, format);
+	serialiser_beginobject(&serialiser);
+	network_dumpstatus(&serialiser);
+	apps_dumpstatus(&serialiser);
+	serialiser_endobject(&serialiser);
+	return http_finishbody(&serialiser);
+}
+
+static const struct cachedbody* http_getstatusbody(enum bodyformat format,
+		gint* generation) {
+	*generation = stategeneration;
+	if (statusbody[format].body == NULL
+			|| statusbodygeneration[format] != *generation) {
+		http_cachedbody_set(&statusbody[format], http_renderstatus(format));
+		statusbodygeneration[format] = *generation;
+	}
+	return &statusbody[format];
+}
+
+static int http_handleconnection_status(struct MHD_Connection* connection,
+		void** con_cls) {
+	enum bodyformat format = http_negotiateformat(connection);
+	gint generation;
+	const struct cachedbody* cached = http_getstatusbody(format, &generation);
+	unsigned int status;
+	struct MHD_Response* response = http_createcachedresponse(connection,
+			con_cls, cached, bodyformatcontenttypes[format],
+			MHD_HTTP_HEADER_ACCEPT, &status);
+	return http_queueresponse(connection, status, response);
+}
+
+static void http_events_appendstatus(GString* event, GBytes* status,
+		gint generation) {
+	gsize statuslen;
+	const gchar* statusdata = g_bytes_get_data(status, &statuslen);
+	g_string_append_printf(event, "id: %d\nevent: status\ndata: ",
+			generation);
+	g_string_append_len(event, statusdata, statuslen);
+	g_string_append(event, "\n\n");
+}
+
+static void http_events_queue(gpointer data, gpointer user_data) {
+	struct eventclient* client = data;
+	const gchar* event = user_data;
+	g_string_append(client->pending, event);
+	if (client->suspended) {
+		client->suspended = FALSE;
+		MHD_resume_connection(client->connection);
+	}
+}
+
+static ssize_t http_events_read(void* cls, uint64_t pos, char* buf,
+		size_t max) {
+	struct eventclient* client = cls;
+	ssize_t ret = 0;
+	if (client->pending->len > 0) {
+		ret = MIN(max, client->pending->len);
+		memcpy(buf, client->pending->str, ret);
+		g_string_erase(client->pending, 0, ret);
+	} else if (eventsstopping)
+		ret = MHD_CONTENT_READER_END_OF_STREAM;
+	else {
+		// nothing to send, park the connection until there is
+		MHD_suspend_connection(client->connection);
+		client->suspended = TRUE;
+	}
+	return ret;
+}
+
+static void http_events_free(void* cls) {
+	struct eventclient* client = cls;
+	eventclients = g_slist_remove(eventclients, client);
+	g_string_free(client->pending, TRUE);
+	g_free(client);
+}
+
+static int http_handleconnection_error(struct MHD_Connection* connection,
+		unsigned int status) {
 	int ret = MHD_NO;
 	static const char* content = "";
 	struct MHD_Response* response = MHD_create_response_from_buffer(
 			strlen(content), (void*) content, MHD_RESPMEM_PERSISTENT);
 	if (response) {
-		ret = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, response);
+		ret = MHD_queue_response(connection, status, response);
 		MHD_destroy_response(response);
 	} else
 		g_message("failed to create response");
 	return ret;
 }
 
-static int http_handleconnection_configure(struct MHD_Connection* connection,
+static int http_handleconnection_events(struct MHD_Connection* connection) {
+	if (g_slist_length(eventclients) >= EVENTS_MAXCLIENTS)
+		return http_handleconnection_error(connection,
+				MHD_HTTP_SERVICE_UNAVAILABLE);
+
+	struct eventclient* client = g_malloc0(sizeof(*client));
+	client->connection = connection;
+	client->pending = g_string_new(NULL);
+
+	// start the client off with the current state
+	gint generation;
+	const struct cachedbody* status = http_getstatusbody(BODYFORMAT_JSON,
+			&generation);
+	http_events_appendstatus(client->pending, status->body, generation);
+
+	struct MHD_Response* response = MHD_create_response_from_callback(
+	MHD_SIZE_UNKNOWN, EVENTS_BLOCKSIZE, http_events_read, client,
+			http_events_free);
+	if (response) {
+		MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE,
+				"text/event-stream");
+		MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL,
+				"no-cache");
+		eventclients = g_slist_prepend(eventclients, client);
+	} else {
+		g_string_free(client->pending, TRUE);
+		g_free(client);
+	}
+	return http_queueresponse(connection, MHD_HTTP_OK, response);
+}
+
+static gboolean http_events_broadcaststatus(gpointer user_data) {
+	eventsidle = 0;
+	if (eventclients != NULL) {
+		gint generation;
+		const struct cachedbody* status = http_getstatusbody(BODYFORMAT_JSON,
+				&generation);
+		GString* event = g_string_new(NULL);
+		http_events_appendstatus(event, status->body, generation);
+		g_slist_foreach(eventclients, http_events_queue, event->str);
+		g_string_free(event, TRUE);
+		http_kick();
+	}
+	return FALSE;
+}
+
+static gboolean http_events_keepalive(gpointer user_data) {
+	g_slist_foreach(eventclients, http_events_queue, ":\n\n");
+	http_kick();
+	return TRUE;
+}
+
+static void http_handleconnection_scan_addscanresult(gpointer data,
+		gpointer userdata) {
+
+	struct network_scanresult* scanresult = (struct network_scanresult*) data;
+	struct serialiser* serialiser = userdata;
+
+	serialiser_beginobject(serialiser);
+	SERIALISER_ADD_STRING(serialiser, "bssid", scanresult->bssid);
+	SERIALISER_ADD_INT(serialiser, "frequency", scanresult->frequency);
+	SERIALISER_ADD_INT(serialiser, "rssi", scanresult->rssi);
+	SERIALISER_ADD_STRING(serialiser, "ssid", scanresult->ssid);
+	if (scanresult->age != 0)
+		SERIALISER_ADD_INT(serialiser, "age_ms", scanresult->age);
+	SERIALISER_ADD_BOOL(serialiser, "thingy",
+			(scanresult->flags & NF_THINGY) != 0);
+	serialiser_endobject(serialiser);
+}
+
+static GBytes* http_renderscanresults(GPtrArray* scanresults,
+		enum bodyformat format) {
+	struct serialiser serialiser;
+	http_startbody(&serialiser, format);
+	serialiser_beginobject(&serialiser);
+	SERIALISER_START_ARRAY(&serialiser, "scanresults");
+	if (scanresults != NULL)
+		g_ptr_array_foreach(scanresults,
+				http_handleconnection_scan_addscanresult, &serialiser);
+	serialiser_endarray(&serialiser);
+	serialiser_endobject(&serialiser);
+	return http_finishbody(&serialiser);
+}
+
+static int http_handleconnection_invalid(struct MHD_Connection* connection) {
+	return http_handleconnection_error(connection, MHD_HTTP_BAD_REQUEST);
+}
+
+static void http_ui_load(void) {
+	for (int i = 0; i < UIENCODING_NUM; i++) {
+		gchar* path = g_strconcat(UI_RESOURCE, uiencodingsuffixes[i], NULL);
+		// resources that aren't compressed in the bundle aren't copied here
+		GBytes* body = g_resources_lookup_data(path,
+				G_RESOURCE_LOOKUP_FLAGS_NONE, NULL);
+		if (body != NULL)
+			http_cachedbody_set(&uibody[i], body);
+		g_free(path);
+	}
+}
+
+static gboolean http_acceptsencoding(const char* acceptencoding,
+		const gchar* encoding) {
+	gboolean accepted = FALSE;
+	gdouble starq = 0;
+	gboolean found = FALSE;
+	gchar** codings = g_strsplit(acceptencoding, ",", -1);
+	for (gchar** coding = codings; *coding != NULL && !found; coding++) {
+		gchar** params = g_strsplit(*coding, ";", -1);
+		if (params[0] == NULL)
+			goto next;
+		gchar* name = g_strstrip(params[0]);
+		gdouble q = 1;
+		for (gchar** param = params + 1; *param != NULL; param++) {
+			gchar* p = g_strstrip(*param);
+			if (g_ascii_strncasecmp(p, "q=", 2) == 0)
+				q = g_ascii_strtod(p + 2, NULL);
+		}
+		if (g_ascii_strcasecmp(name, encoding) == 0) {
+			accepted = q > 0;
+			found = TRUE;
+		} else if (strcmp(name, "*") == 0)
+			starq = q;
+		next: //
+		g_strfreev(params);
+	}
+	g_strfreev(codings);
+	return found ? accepted : starq > 0;
+}
+
+static int http_handleconnection_ui(struct MHD_Connection* connection,
 		void** con_cls) {
-	struct postconninfo* con_info = *con_cls;
-	int ret = MHD_NO;
-	GBytes* bytes = g_byte_array_free_to_bytes(con_info->payload);
-	con_info->payload = NULL;
-	JsonParser* jsonparser = json_parser_new();
-	gsize sz;
-	gconstpointer data = g_bytes_get_data(bytes, &sz);
-	if (sz == 0) {
-		g_message("0 byte payload");
-		goto invalidrequest;
+	const char* acceptencoding = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+	// the best compression the client can take wins
+	enum uiencoding encoding = UIENCODING_IDENTITY;
+	for (int i = UIENCODING_NUM - 1; i > UIENCODING_IDENTITY; i--) {
+		if (uibody[i].body != NULL && acceptencoding != NULL
+				&& http_acceptsencoding(acceptencoding, uiencodingnames[i])) {
+			encoding = i;
+			break;
+		}
+	}
+
+	const struct cachedbody* cached = &uibody[encoding];
+	if (cached->body == NULL)
+		return http_handleconnection_error(connection, MHD_HTTP_NOT_FOUND);
+
+	unsigned int status;
+	struct MHD_Response* response = http_createcachedresponse(connection,
+			con_cls, cached, UI_CONTENTTYPE, MHD_HTTP_HEADER_ACCEPT_ENCODING,
+			&status);
+	if (response != NULL) {
+		if (encoding != UIENCODING_IDENTITY)
+			MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING,
+					uiencodingnames[encoding]);
+		MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL,
+		UI_CACHECONTROL);
+	}
+	return http_queueresponse(connection, status, response);
+}
+
+static gboolean http_scanwaittimeout(gpointer user_data);
+
+static gboolean http_scanfilter_parse(struct MHD_Connection* connection,
+		struct scanfilter* filter) {
+	memset(filter, 0, sizeof(*filter));
+
+	const char* minrssistr = MHD_lookup_connection_value(connection,
+			MHD_GET_ARGUMENT_KIND, SCAN_ARG_MINRSSI);
+	if (minrssistr != NULL) {
+		gint64 minrssi;
+		if (!g_ascii_string_to_signed(minrssistr, 10, G_MININT8, G_MAXINT8,
+				&minrssi, NULL))
+			return FALSE;
+		filter->hasminrssi = TRUE;
+		filter->minrssi = minrssi;
+	}
+
+	const char* bandstr = MHD_lookup_connection_value(connection,
+			MHD_GET_ARGUMENT_KIND, SCAN_ARG_BAND);
+	if (bandstr != NULL) {
+		if (strcmp(bandstr, SCAN_BAND_24GHZ) == 0)
+			filter->band = SCANBAND_24GHZ;
+		else if (strcmp(bandstr, SCAN_BAND_5GHZ) == 0)
+			filter->band = SCANBAND_5GHZ;
+		else
+			return FALSE;
+	}
+
+	const char* dedupestr = MHD_lookup_connection_value(connection,
+			MHD_GET_ARGUMENT_KIND, SCAN_ARG_DEDUPE);
+	if (dedupestr != NULL) {
+		if (strcmp(dedupestr, SCAN_DEDUPE_SSID) != 0)
+			return FALSE;
+		filter->dedupessid = TRUE;
+	}
+
+	const char* limitstr = MHD_lookup_connection_value(connection,
+			MHD_GET_ARGUMENT_KIND, SCAN_ARG_LIMIT);
+	if (limitstr != NULL) {
+		guint64 limit;
+		if (!g_ascii_string_to_unsigned(limitstr, 10, 1, G_MAXUINT32, &limit,
+		NULL))
+			return FALSE;
+		filter->limit = limit;
+	}
+
+	filter->active = filter->hasminrssi || filter->band != SCANBAND_ANY
+			|| filter->dedupessid || filter->limit != 0;
+	return TRUE;
+}
+
+static gboolean http_scanfilter_inband(enum scanband band, int frequency) {
+	switch (band) {
+	case SCANBAND_24GHZ:
+		return frequency >= 2400 && frequency < 2500;
+	case SCANBAND_5GHZ:
+		return frequency >= 4900 && frequency < 6000;
+	default:
+		return TRUE;
+	}
+}
+
+static gint http_scanfilter_comparerssi(gconstpointer a, gconstpointer b) {
+	const struct network_scanresult* l = *((struct network_scanresult**) a);
+	const struct network_scanresult* r = *((struct network_scanresult**) b);
+	return r->rssi - l->rssi;
+}
+
+/* The filtered array borrows the results from the cached array. Dedupe
+ * and limit only make sense if the strongest results come first so if
+ * either is used the results are sorted by rssi. Hidden networks don't
+ * have an ssid to dedupe on so they are all kept.
+ */
+static GPtrArray* http_scanfilter_apply(const struct scanfilter* filter,
+		GArray* scanresults) {
+	if (scanresults == NULL)
+		return g_ptr_array_new();
+
+	GPtrArray* filtered = g_ptr_array_sized_new(scanresults->len);
+	for (guint i = 0; i < scanresults->len; i++) {
+		struct network_scanresult* scanresult = &g_array_index(scanresults,
+				struct network_scanresult, i);
+		if (filter->hasminrssi && scanresult->rssi < filter->minrssi)
+			continue;
+		if (!http_scanfilter_inband(filter->band, scanresult->frequency))
+			continue;
+		g_ptr_array_add(filtered, scanresult);
+	}
+
+	if (filter->dedupessid || filter->limit != 0)
+		g_ptr_array_sort(filtered, http_scanfilter_comparerssi);
+
+	if (filter->dedupessid) {
+		GHashTable* seen = g_hash_table_new(g_str_hash, g_str_equal);
+		guint kept = 0;
+		for (guint i = 0; i < filtered->len; i++) {
+			struct network_scanresult* scanresult = g_ptr_array_index(filtered,
+					i);
+			if (*scanresult->ssid != '\0') {
+				if (g_hash_table_contains(seen, scanresult->ssid))
+					continue;
+				g_hash_table_add(seen, scanresult->ssid);
+			}
+			g_ptr_array_index(filtered, kept++) = scanresult;
+		}
+		g_ptr_array_set_size(filtered, kept);
+		g_hash_table_unref(seen);
+	}
+
+	if (filter->limit != 0 && filtered->len > filter->limit)
+		g_ptr_array_set_size(filtered, filter->limit);
+
+	return filtered;
+}
+
+static int http_handleconnection_scan(struct MHD_Connection* connection,
+		void** con_cls) {
+	struct conninfo* con_info = http_getconninfo(con_cls);
+	gboolean waitforscan = TRUE;
+
+	struct scanfilter filter;
+	if (!http_scanfilter_parse(connection, &filter))
+		return http_handleconnection_invalid(connection);
+
+	/* the connection was parked until new scan results arrived and has been
+	 * resumed, so whatever is cached now is what it gets.
+	 */
+	if (con_info->scanwaiting)
+		waitforscan = FALSE;
+	else {
+		const char* maxagestr = MHD_lookup_connection_value(connection,
+				MHD_GET_ARGUMENT_KIND, SCAN_ARG_MAXAGE);
+		if (maxagestr != NULL) {
+			guint64 maxage;
+			if (!g_ascii_string_to_unsigned(maxagestr, 10, 0, G_MAXUINT32,
+					&maxage, NULL))
+				return http_handleconnection_invalid(connection);
+			if (scanbodytime != 0
+					&& (g_get_monotonic_time() - scanbodytime)
+							<= (maxage * G_USEC_PER_SEC))
+				waitforscan = FALSE;
+		}
+	}
+
+	/* if the scan was throttled there won't be any new results coming so
+	 * just hand over what we already have.
+	 */
+	if (waitforscan && network_scan()) {
+		MHD_suspend_connection(connection);
+		con_info->scanwaiting = TRUE;
+		if (scanwaiters == NULL)
+			scanwaittimeout = g_timeout_add_seconds(SCAN_WAITTIMEOUT,
+					http_scanwaittimeout, NULL);
+		scanwaiters = g_slist_prepend(scanwaiters, connection);
+		return MHD_YES;
+	}
+
+	enum bodyformat format = http_negotiateformat(connection);
+	if (scanbody[format].body == NULL) {
+		// an empty filter lets everything through
+		struct scanfilter nofilter = { 0 };
+		GPtrArray* all = http_scanfilter_apply(&nofilter, scanresultscache);
+		http_cachedbody_set(&scanbody[format],
+				http_renderscanresults(all, format));
+		g_ptr_array_unref(all);
 	}
 
-	if (!json_parser_load_from_data(jsonparser, data, sz, NULL)) {
-		g_message("failed to parse json");
-		goto invalidrequest;
+	// filtered results are specific to the request so aren't cached
+	struct cachedbody filteredbody = { 0 };
+	const struct cachedbody* body = &scanbody[format];
+	if (filter.active) {
+		GPtrArray* filtered = http_scanfilter_apply(&filter, scanresultscache);
+		http_cachedbody_set(&filteredbody,
+				http_renderscanresults(filtered, format));
+		g_ptr_array_unref(filtered);
+		body = &filteredbody;
 	}
 
-	JsonNode* root = json_parser_get_root(jsonparser);
-	struct network_config* ntwkcfg = network_model_config_deserialise(root);
-	if (ntwkcfg == NULL) {
-		goto invalidrequest;
+	unsigned int status;
+	struct MHD_Response* response = http_createcachedresponse(connection,
+			con_cls, body, bodyformatcontenttypes[format],
+			MHD_HTTP_HEADER_ACCEPT, &status);
+	http_cachedbody_clear(&filteredbody);
+	// let the client know how stale the results are
+	if (response != NULL && scanbodytime != 0) {
+		gchar agestr[16];
+		g_snprintf(agestr, sizeof(agestr), "%d",
+				(int) ((g_get_monotonic_time() - scanbodytime)
+						/ G_USEC_PER_SEC));
+		MHD_add_response_header(response, MHD_HTTP_HEADER_AGE, agestr);
 	}
+	return http_queueresponse(connection, status, response);
+}
+
+static int http_handleconnection_configure(struct MHD_Connection* connection,
+		void** con_cls) {
+	struct conninfo* con_info = *con_cls;
+
+	struct network_config* ntwkcfg = network_model_configparser_finish(
+			con_info->configparser);
+	con_info->configparser = NULL;
+	if (ntwkcfg == NULL)
+		return http_handleconnection_invalid(connection);
 
 	gboolean configuring = network_configure(ntwkcfg);
+	// if it wasn't taken the config is still ours
+	if (!configuring)
+		g_free(ntwkcfg);
 
-	JsonBuilder* jsonbuilder = json_builder_new();
-	json_builder_begin_object(jsonbuilder);
-	json_builder_set_member_name(jsonbuilder, "configuring");
-	json_builder_add_boolean_value(jsonbuilder, configuring);
-	json_builder_end_object(jsonbuilder);
-	gsize contentln;
-	char* content = jsonbuilder_freetostring(jsonbuilder, &contentln, FALSE);
+	struct serialiser serialiser;
+	http_startbody(&serialiser, BODYFORMAT_JSON);
+	serialiser_beginobject(&serialiser);
+	SERIALISER_ADD_BOOL(&serialiser, "configuring", configuring);
+	serialiser_endobject(&serialiser);
 
-	struct MHD_Response* response = MHD_create_response_from_buffer(contentln,
-			(void*) content, MHD_RESPMEM_MUST_COPY);
-	if (response) {
-		ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-		MHD_destroy_response(response);
-	} else
-		g_message("failed to create response");
-	g_free(content);
-	goto out;
+	con_info->bytes = serialiser.buf->len;
+	return http_queueresponse(connection, MHD_HTTP_OK,
+			http_createrenderedresponse(&serialiser));
+}
+
+/* once a post has been rejected whatever else the client sends is
+ * thrown away without looking at it. microhttpd won't take a response
+ * while the body is still coming in so the status is kept until the
+ * last call for the request.
+ */
+static void http_rejectpost(struct conninfo* con_info, unsigned int status) {
+	con_info->rejected = TRUE;
+	con_info->rejectstatus = status;
+	if (con_info->configparser != NULL) {
+		network_model_configparser_free(con_info->configparser);
+		con_info->configparser = NULL;
+	}
+}
 
-	invalidrequest: ret = http_handleconnection_invalid(connection);
-	out: g_object_unref(jsonparser);
-	g_bytes_unref(bytes);
+/* rejecting a post before any of the body has been read means clients
+ * that sent Expect: 100-continue don't have to send it.
+ */
+static int http_rejectpostnow(struct MHD_Connection* connection,
+		struct conninfo* con_info, unsigned int status) {
+	http_rejectpost(con_info, status);
+	con_info->rejectstatus = 0;
+	return http_handleconnection_error(connection, status);
+}
 
-	return ret;
+static int http_finishrejectedpost(struct MHD_Connection* connection,
+		struct conninfo* con_info) {
+	// already answered when the headers came in
+	if (con_info->rejectstatus == 0)
+		return MHD_YES;
+	unsigned int status = con_info->rejectstatus;
+	con_info->rejectstatus = 0;
+	return http_handleconnection_error(connection, status);
 }
 
-static int http_handleconnection_continuemunchingpost(const char* upload_data,
+static int http_handleconnection_continuemunchingpost(
+		struct MHD_Connection* connection, const char* upload_data,
 		size_t* upload_data_size, void** con_cls) {
-	struct postconninfo* con_info = *con_cls;
-	g_message("continuing to eat post, %zu", *upload_data_size);
-	g_byte_array_append(con_info->payload, (const guint8*) upload_data,
-			*upload_data_size);
+	struct conninfo* con_info = *con_cls;
+	gsize len = *upload_data_size;
 	*upload_data_size = 0;
+
+	if (con_info->rejected)
+		return MHD_YES;
+
+	con_info->uploaded += len;
+	if (con_info->uploaded > CONFIG_MAXBODY) {
+		g_message("post is too big");
+		http_rejectpost(con_info, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE);
+		return MHD_YES;
+	}
+
+	if (!network_model_configparser_feed(con_info->configparser, upload_data,
+			len))
+		http_rejectpost(con_info, MHD_HTTP_BAD_REQUEST);
+
 	return MHD_YES;
 }
 
+static gboolean http_isjson(const char* contenttype) {
+	if (contenttype == NULL)
+		return FALSE;
+	// ignore any parameters like the charset
+	gsize len = strcspn(contenttype, ";");
+	while (len > 0 && g_ascii_isspace(contenttype[len - 1]))
+		len--;
+	return len == strlen(CONFIG_CONTENTTYPE)
+			&& g_ascii_strncasecmp(contenttype, CONFIG_CONTENTTYPE, len) == 0;
+}
+
 static int http_handleconnection_startmunchingpost(
 		struct MHD_Connection* connection, void** con_cls) {
 	g_message("starting to eat post");
-	struct postconninfo* con_info = g_malloc0(sizeof(struct postconninfo));
-	con_info->payload = g_byte_array_new();
-	*con_cls = con_info;
+	struct conninfo* con_info = http_getconninfo(con_cls);
+
+	const char* contenttype = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_TYPE);
+	if (!http_isjson(contenttype)) {
+		g_message("bad content type for post");
+		return http_rejectpostnow(connection, con_info,
+		MHD_HTTP_UNSUPPORTED_MEDIA_TYPE);
+	}
+
+	// if the client told us how big the post is reject it up front
+	const char* contentlengthstr = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_LENGTH);
+	guint64 contentlength;
+	if (contentlengthstr != NULL
+			&& (!g_ascii_string_to_unsigned(contentlengthstr, 10, 0,
+			G_MAXUINT64, &contentlength, NULL)
+					|| contentlength > CONFIG_MAXBODY)) {
+		g_message("post is too big");
+		return http_rejectpostnow(connection, con_info,
+		MHD_HTTP_REQUEST_ENTITY_TOO_LARGE);
+	}
+
+	con_info->configparser = network_model_configparser_new();
 	return MHD_YES;
 }
 
+static void http_tls_connectionnotify(void* cls,
+		struct MHD_Connection* connection, void** socket_context,
+		enum MHD_ConnectionNotificationCode toe) {
+	switch (toe) {
+	case MHD_CONNECTION_NOTIFY_STARTED: {
+		struct tlsconninfo* tlsconn = g_malloc0(sizeof(*tlsconn));
+		tlsconn->accepted = g_get_monotonic_time();
+		*socket_context = tlsconn;
+		const union MHD_ConnectionInfo* info = MHD_get_connection_info(
+				connection, MHD_CONNECTION_INFO_GNUTLS_SESSION);
+		if (info != NULL)
+			gnutls_session_ticket_enable_server(
+					(gnutls_session_t) info->tls_session, &ticketkey);
+	}
+		break;
+	case MHD_CONNECTION_NOTIFY_CLOSED:
+		g_free(*socket_context);
+		*socket_context = NULL;
+		break;
+	}
+}
+
+/* The first request on a connection marks the end of the handshake, the
+ * time to it includes receiving the request headers but that's small
+ * compared to the handshake itself.
+ */
+static void http_tls_onrequest(struct MHD_Connection* connection) {
+	const union MHD_ConnectionInfo* info = MHD_get_connection_info(connection,
+			MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+	if (info == NULL || info->socket_context == NULL)
+		return;
+	struct tlsconninfo* tlsconn = info->socket_context;
+
+	tlsrequests++;
+	if (tlsconn->handshaken)
+		return;
+	tlsconn->handshaken = TRUE;
+
+	gint64 handshaketime = g_get_monotonic_time() - tlsconn->accepted;
+	tlshandshakes++;
+	tlshandshaketime += handshaketime;
+	tlsmaxhandshaketime = MAX(tlsmaxhandshaketime, handshaketime);
+
+	info = MHD_get_connection_info(connection,
+			MHD_CONNECTION_INFO_GNUTLS_SESSION);
+	if (info != NULL
+			&& gnutls_session_is_resumed((gnutls_session_t) info->tls_session))
+		tlsresumed++;
+}
+
 static int http_handleconnection(void* cls, struct MHD_Connection* connection,
 		const char* url, const char* method, const char* version,
 		const char* upload_data, size_t* upload_data_size, void** con_cls) {
 	g_message("handling request %s for %s", method, url);
 
+	gboolean firstcall = (*con_cls == NULL);
+	if (tls && firstcall)
+		http_tls_onrequest(connection);
+
 	int ret = MHD_NO;
 	gboolean isget = (strcmp(method, MHD_HTTP_METHOD_GET) == 0);
 	gboolean ispost = (strcmp(method, MHD_HTTP_METHOD_POST) == 0);
-	if (isget && (strcmp(url, ENDPOINT_STATUS) == 0))
-		ret = http_handleconnection_status(connection);
-	else if (isget && (strcmp(url, ENDPOINT_SCAN) == 0))
-		ret = http_handleconnection_scan(connection);
+	if (isget && (strcmp(url, ENDPOINT_STATUS) == 0)) {
+		http_startrequest(con_cls, &statushistogram);
+		ret = http_handleconnection_status(connection, con_cls);
+	} else if (isget && (strcmp(url, ENDPOINT_SCAN) == 0)) {
+		http_startrequest(con_cls, &scanhistogram);
+		ret = http_handleconnection_scan(connection, con_cls);
+	} else if (isget && (strcmp(url, ENDPOINT_UI) == 0))
+		ret = http_handleconnection_ui(connection, con_cls);
+	else if (isget && (strcmp(url, ENDPOINT_EVENTS) == 0))
+		ret = http_handleconnection_events(connection);
 	else if (isget && (strcmp(url, ENDPOINT_DEBUG) == 0)) {
 		ret = http_handleconnection_debug(connection);
 	} else if (ispost && (strcmp(url, ENDPOINT_CONFIG) == 0)) {
-		if (*con_cls == NULL
-				&& strcmp(
-						MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
-						MHD_HTTP_HEADER_CONTENT_TYPE), "application/json")
-						== 0) {
+		http_startrequest(con_cls, &confighistogram);
+		// the first call only has the headers
+		if (firstcall)
 			ret = http_handleconnection_startmunchingpost(connection, con_cls);
-		} else if (*upload_data_size != 0)
-			ret = http_handleconnection_continuemunchingpost(upload_data,
-					upload_data_size, con_cls);
+		else if (*upload_data_size != 0)
+			ret = http_handleconnection_continuemunchingpost(connection,
+					upload_data, upload_data_size, con_cls);
+		else if (((struct conninfo*) *con_cls)->rejected)
+			ret = http_finishrejectedpost(connection, *con_cls);
 		else
 			ret = http_handleconnection_configure(connection, con_cls);
 	} else {
@@ -227,29 +1129,145 @@ static int http_handleconnection(void* cls, struct MHD_Connection* connection,
 
 static void http_requestcompleted(void *cls, struct MHD_Connection *connection,
 		void **con_cls, enum MHD_RequestTerminationCode toe) {
-	struct postconninfo* con_info = *con_cls;
+	struct conninfo* con_info = *con_cls;
 	if (NULL == con_info)
 		return;
-	if (con_info->payload)
-		g_byte_array_free(con_info->payload, TRUE);
+	if (con_info->histogram != NULL)
+		http_histogram_record(con_info->histogram,
+				g_get_monotonic_time() - con_info->started, con_info->bytes);
+	if (con_info->configparser)
+		network_model_configparser_free(con_info->configparser);
+	if (con_info->body)
+		g_bytes_unref(con_info->body);
 	g_free(con_info);
 	*con_cls = NULL;
 }
 
-int http_start() {
-	mhd = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, PORT, NULL, NULL,
-			http_handleconnection, NULL,
+int http_start(const struct certs* certs) {
+	unsigned int flags = MHD_USE_EPOLL | MHD_USE_SUSPEND_RESUME;
+	struct MHD_OptionItem tlsoptions[] = { //
+			{ MHD_OPTION_END, 0, NULL }, //
+			{ MHD_OPTION_END, 0, NULL }, //
+			{ MHD_OPTION_END, 0, NULL }, //
+			{ MHD_OPTION_END, 0, NULL } };
+
+	if (certs != NULL) {
+		if (gnutls_session_ticket_key_generate(&ticketkey) != GNUTLS_E_SUCCESS) {
+			g_message("failed to generate session ticket key");
+			return 1;
+		}
+		tls = TRUE;
+		flags |= MHD_USE_TLS;
+		struct MHD_OptionItem options[] = { //
+				{ MHD_OPTION_HTTPS_MEM_KEY, 0, certs->key }, //
+				{ MHD_OPTION_HTTPS_MEM_CERT, 0, certs->cert }, //
+				{ MHD_OPTION_NOTIFY_CONNECTION,
+						(intptr_t) http_tls_connectionnotify, NULL } };
+		memcpy(tlsoptions, options, sizeof(options));
+	}
+
+	mhd = MHD_start_daemon(flags, PORT, NULL, NULL, http_handleconnection,
+	NULL,
 			// options
 			MHD_OPTION_NOTIFY_COMPLETED, http_requestcompleted, NULL,
-			MHD_OPTION_CONNECTION_LIMIT, (unsigned int) 2, MHD_OPTION_END);
+			MHD_OPTION_CONNECTION_LIMIT, (unsigned int) CONNECTION_LIMIT,
+			MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) CONNECTION_TIMEOUT,
+			MHD_OPTION_ARRAY, tlsoptions, MHD_OPTION_END);
 
 	if (mhd == NULL)
 		return 1;
 
+	renderbuf = g_byte_array_new();
+	http_ui_load();
+
+	const union MHD_DaemonInfo* epollfd = MHD_get_daemon_info(mhd,
+			MHD_DAEMON_INFO_EPOLL_FD);
+	mhdwatch = utils_addwatchforsocketfd(epollfd->epoll_fd, G_IO_IN,
+			http_onepollfd, NULL);
+	http_run();
+
+	eventskeepalive = g_timeout_add_seconds(EVENTS_KEEPALIVE,
+			http_events_keepalive, NULL);
+
 	return 0;
 }
 
+static void http_resumescanwaiter(gpointer data, gpointer user_data) {
+	struct MHD_Connection* connection = data;
+	MHD_resume_connection(connection);
+}
+
+static void http_releasescanwaiters(void) {
+	if (scanwaiters == NULL)
+		return;
+	g_slist_foreach(scanwaiters, http_resumescanwaiter, NULL);
+	g_slist_free(scanwaiters);
+	scanwaiters = NULL;
+	if (scanwaittimeout != 0) {
+		g_source_remove(scanwaittimeout);
+		scanwaittimeout = 0;
+	}
+	http_kick();
+}
+
+static gboolean http_scanwaittimeout(gpointer user_data) {
+	g_message("timed out waiting for scan results");
+	scanwaittimeout = 0;
+	http_releasescanwaiters();
+	return FALSE;
+}
+
 void http_stop() {
+	// mhd won't stop with suspended connections
+	http_releasescanwaiters();
+	eventsstopping = TRUE;
+	g_slist_foreach(eventclients, http_events_queue, "");
+	g_source_remove(eventskeepalive);
+	if (eventsidle != 0)
+		g_source_remove(eventsidle);
+	g_source_remove(mhdwatch);
+	if (mhdtimeout != 0)
+		g_source_remove(mhdtimeout);
+	if (mhdkick != 0)
+		g_source_remove(mhdkick);
 	MHD_stop_daemon(mhd);
 	mhd = NULL;
+	for (int i = 0; i < BODYFORMAT_NUM; i++) {
+		http_cachedbody_clear(&statusbody[i]);
+		http_cachedbody_clear(&scanbody[i]);
+	}
+	for (int i = 0; i < UIENCODING_NUM; i++)
+		http_cachedbody_clear(&uibody[i]);
+	g_byte_array_unref(renderbuf);
+	renderbuf = NULL;
+	if (scanresultscache != NULL) {
+		g_array_unref(scanresultscache);
+		scanresultscache = NULL;
+	}
+	if (tls) {
+		gnutls_memset(ticketkey.data, 0, ticketkey.size);
+		gnutls_free(ticketkey.data);
+		ticketkey.data = NULL;
+		tls = FALSE;
+	}
+}
+
+void http_onstatechange() {
+	stategeneration++;
+	/* a single change usually fires a few of the hooks so push the new
+	 * state to event clients once things have settled.
+	 */
+	if (eventclients != NULL && eventsidle == 0)
+		eventsidle = g_idle_add(http_events_broadcaststatus, NULL);
+}
+
+void http_onscanresults(GArray* scanresults) {
+	if (scanresultscache != NULL)
+		g_array_unref(scanresultscache);
+	scanresultscache = scanresults != NULL ? g_array_ref(scanresults) : NULL;
+	// rendered again in whatever formats are asked for
+	for (int i = 0; i < BODYFORMAT_NUM; i++)
+		http_cachedbody_clear(&scanbody[i]);
+	scanbodytime = g_get_monotonic_time();
+	http_releasescanwaiters();
 }
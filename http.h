@@ -1,4 +1,9 @@
 #pragma once
 
-int http_start(void);
+#include <glib.h>
+#include "certs.h"
+
+int http_start(const struct certs* certs);
 void http_stop(void);
+void http_onstatechange(void);
+void http_onscanresults(GArray* scanresults);
@@ -0,0 +1,293 @@
+/* Load generator for the http side of thingymcconfig. It starts the daemon
+ * with --nonetwork so the network model is stubbed, hammers /status, /scan
+ * and /config from a few keep-alive connections and then reports the
+ * throughput and latency percentiles for each end point.
+ */
+
+#define GETTEXT_PACKAGE "gtk20"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define HOST "127.0.0.1"
+#define PORT 1338
+// how long to wait for the daemon to start listening in milliseconds
+#define STARTUPTIMEOUT 5000
+#define STARTUPPOLL 50
+
+#define CONFIGBODY "{\"ssid\":\"thingy-home\",\"psk\":\"notverysecret\"}"
+
+enum request {
+	REQ_STATUS, REQ_SCAN, REQ_CONFIG, REQ_NUM
+};
+
+static const gchar* requestnames[] = { [REQ_STATUS] = "status", [REQ_SCAN
+		] = "scan", [REQ_CONFIG] = "config" };
+
+static const gchar* requests[] = { [REQ_STATUS
+		] = "GET /status HTTP/1.1\r\nHost: " HOST "\r\n\r\n", [REQ_SCAN
+		] = "GET /scan HTTP/1.1\r\nHost: " HOST "\r\n\r\n", [REQ_CONFIG
+		] = "POST /config HTTP/1.1\r\nHost: " HOST "\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: 45\r\n\r\n" CONFIGBODY };
+
+G_STATIC_ASSERT(sizeof(CONFIGBODY) - 1 == 45);
+
+struct client {
+	GThread* thread;
+	guint requests;
+	GArray* latencies[REQ_NUM];
+	guint errors;
+};
+
+static gint clients = 4;
+static gint requestsperclient = 1000;
+
+static GSocketConnection* httpbench_connect(void) {
+	GSocketClient* socketclient = g_socket_client_new();
+	GSocketConnection* connection = g_socket_client_connect_to_host(
+			socketclient, HOST, PORT, NULL, NULL);
+	g_object_unref(socketclient);
+	return connection;
+}
+
+/* reads a single response, returns the status code or 0 if the
+ * connection was lost.
+ */
+static guint httpbench_readresponse(GDataInputStream* dis,
+		gboolean* closed) {
+	guint status = 0;
+	guint64 contentlength = 0;
+
+	gchar* statusline = g_data_input_stream_read_line(dis, NULL, NULL, NULL);
+	if (statusline == NULL)
+		goto err_statusline;
+	gchar** statusparts = g_strsplit(statusline, " ", 3);
+	if (g_strv_length(statusparts) >= 2)
+		status = g_ascii_strtoull(statusparts[1], NULL, 10);
+	g_strfreev(statusparts);
+	g_free(statusline);
+
+	for (;;) {
+		gchar* header = g_data_input_stream_read_line(dis, NULL, NULL, NULL);
+		if (header == NULL) {
+			status = 0;
+			goto err_headers;
+		}
+		g_strchomp(header);
+		if (*header == '\0') {
+			g_free(header);
+			break;
+		}
+		gchar* value = strchr(header, ':');
+		if (value != NULL) {
+			*value++ = '\0';
+			g_strstrip(value);
+			if (g_ascii_strcasecmp(header, "Content-Length") == 0)
+				contentlength = g_ascii_strtoull(value, NULL, 10);
+			else if (g_ascii_strcasecmp(header, "Connection") == 0
+					&& g_ascii_strcasecmp(value, "close") == 0)
+				*closed = TRUE;
+		}
+		g_free(header);
+	}
+
+	if (contentlength > 0) {
+		gchar* body = g_malloc(contentlength);
+		gsize bytesread;
+		if (!g_input_stream_read_all(G_INPUT_STREAM(dis), body, contentlength,
+				&bytesread, NULL, NULL) || bytesread != contentlength)
+			status = 0;
+		g_free(body);
+	}
+
+	err_headers: //
+	err_statusline: //
+	return status;
+}
+
+static gpointer httpbench_client(gpointer data) {
+	struct client* client = data;
+	GSocketConnection* connection = NULL;
+	GDataInputStream* dis = NULL;
+
+	for (guint i = 0; i < client->requests; i++) {
+		if (connection == NULL) {
+			connection = httpbench_connect();
+			if (connection == NULL) {
+				client->errors++;
+				break;
+			}
+			dis = g_data_input_stream_new(
+					g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+			g_data_input_stream_set_newline_type(dis,
+					G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+		}
+
+		enum request req = i % REQ_NUM;
+		gboolean closed = FALSE;
+		gint64 start = g_get_monotonic_time();
+		guint status = 0;
+		if (g_output_stream_write_all(
+				g_io_stream_get_output_stream(G_IO_STREAM(connection)),
+				requests[req], strlen(requests[req]), NULL, NULL, NULL))
+			status = httpbench_readresponse(dis, &closed);
+		gint64 latency = g_get_monotonic_time() - start;
+
+		if (status == 200)
+			g_array_append_val(client->latencies[req], latency);
+		else
+			client->errors++;
+
+		if (status == 0 || closed) {
+			g_object_unref(dis);
+			g_object_unref(connection);
+			dis = NULL;
+			connection = NULL;
+		}
+	}
+
+	if (connection != NULL) {
+		g_object_unref(dis);
+		g_object_unref(connection);
+	}
+	return NULL;
+}
+
+static gboolean httpbench_waitfordaemon(void) {
+	for (int i = 0; i < STARTUPTIMEOUT / STARTUPPOLL; i++) {
+		GSocketConnection* connection = httpbench_connect();
+		if (connection != NULL) {
+			g_object_unref(connection);
+			return TRUE;
+		}
+		g_usleep(STARTUPPOLL * 1000);
+	}
+	return FALSE;
+}
+
+static gint httpbench_compare(gconstpointer a, gconstpointer b) {
+	gint64 l = *((const gint64*) a), r = *((const gint64*) b);
+	return (l > r) - (l < r);
+}
+
+static gint64 httpbench_percentile(GArray* latencies, guint percentile) {
+	if (latencies->len == 0)
+		return 0;
+	guint index = ((latencies->len * percentile) + 99) / 100;
+	return g_array_index(latencies, gint64, MAX(index, 1) - 1);
+}
+
+static void httpbench_report(struct client* clientstate, gint64 elapsed) {
+	guint total = 0, errors = 0;
+	for (int c = 0; c < clients; c++)
+		errors += clientstate[c].errors;
+
+	g_print("%-8s %8s %10s %10s %10s %10s\n", "endpoint", "requests",
+			"p50(us)", "p90(us)", "p99(us)", "max(us)");
+	for (int r = 0; r < REQ_NUM; r++) {
+		GArray* latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+		for (int c = 0; c < clients; c++)
+			g_array_append_vals(latencies, clientstate[c].latencies[r]->data,
+					clientstate[c].latencies[r]->len);
+		g_array_sort(latencies, httpbench_compare);
+		total += latencies->len;
+		g_print("%-8s %8u %10"G_GINT64_FORMAT" %10"G_GINT64_FORMAT
+		" %10"G_GINT64_FORMAT" %10"G_GINT64_FORMAT"\n", requestnames[r],
+				latencies->len, httpbench_percentile(latencies, 50),
+				httpbench_percentile(latencies, 90),
+				httpbench_percentile(latencies, 99),
+				latencies->len > 0 ?
+						g_array_index(latencies, gint64, latencies->len - 1) :
+						0);
+		g_array_free(latencies, TRUE);
+	}
+	g_print("%u requests in %.2f seconds, %.1f requests/sec, %u errors\n",
+			total, elapsed / (double) G_USEC_PER_SEC,
+			total / (elapsed / (double) G_USEC_PER_SEC), errors);
+}
+
+int main(int argc, char** argv) {
+	int ret = 1;
+	GError* error = NULL;
+
+	GOptionEntry entries[] = { { "clients", 'c', 0, G_OPTION_ARG_INT, &clients,
+			"number of concurrent connections, the daemon only allows 4",
+			NULL }, { "requests", 'n', 0, G_OPTION_ARG_INT, &requestsperclient,
+			"number of requests per connection", NULL }, { NULL } };
+	GOptionContext* optioncontext = g_option_context_new("THINGYMCCONFIG");
+	g_option_context_add_main_entries(optioncontext, entries, GETTEXT_PACKAGE);
+	if (!g_option_context_parse(optioncontext, &argc, &argv, &error)) {
+		g_print("option parsing failed: %s\n", error->message);
+		goto err_args;
+	}
+	if (argc != 2 || clients < 1 || requestsperclient < 1) {
+		g_print("usage: %s [--clients n] [--requests n] path/to/thingymcconfig\n",
+				argv[0]);
+		goto err_args;
+	}
+
+	gchar* tmpdir = g_dir_make_tmp("httpbench-XXXXXX", &error);
+	if (tmpdir == NULL) {
+		g_print("failed to create temp dir: %s\n", error->message);
+		goto err_tmpdir;
+	}
+	gchar* configpath = g_build_filename(tmpdir, "config.json", NULL);
+
+	gchar* daemonargv[] = { argv[1], "--interface", "bench0", "--config",
+			configpath, "--nonetwork", NULL };
+	GPid pid;
+	if (!g_spawn_async(NULL, daemonargv, NULL,
+			G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL
+					| G_SPAWN_STDERR_TO_DEV_NULL, NULL, NULL, &pid, &error)) {
+		g_print("failed to start daemon: %s\n", error->message);
+		goto err_spawn;
+	}
+
+	if (!httpbench_waitfordaemon()) {
+		g_print("daemon didn't start listening\n");
+		goto err_waitfordaemon;
+	}
+
+	struct client* clientstate = g_new0(struct client, clients);
+	gint64 start = g_get_monotonic_time();
+	for (int c = 0; c < clients; c++) {
+		clientstate[c].requests = requestsperclient;
+		for (int r = 0; r < REQ_NUM; r++)
+			clientstate[c].latencies[r] = g_array_new(FALSE, FALSE,
+					sizeof(gint64));
+		clientstate[c].thread = g_thread_new("client", httpbench_client,
+				&clientstate[c]);
+	}
+	for (int c = 0; c < clients; c++)
+		g_thread_join(clientstate[c].thread);
+	gint64 elapsed = g_get_monotonic_time() - start;
+
+	httpbench_report(clientstate, elapsed);
+
+	ret = 0;
+	for (int c = 0; c < clients; c++) {
+		if (clientstate[c].errors != 0)
+			ret = 1;
+		for (int r = 0; r < REQ_NUM; r++)
+			g_array_free(clientstate[c].latencies[r], TRUE);
+	}
+	g_free(clientstate);
+
+	err_waitfordaemon: //
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+	g_spawn_close_pid(pid);
+	err_spawn: //
+	g_unlink(configpath);
+	g_rmdir(tmpdir);
+	g_free(configpath);
+	g_free(tmpdir);
+	err_tmpdir: //
+	err_args: //
+	g_option_context_free(optioncontext);
+	return ret;
+}
@@ -7,11 +7,12 @@
 #include "network_priv.h"
 
 #include "network_wpasupplicant.h"
+#include "network_scan_nl80211.h"
 #include "network_dhcp.h"
 #include "config.h"
-#include "jsonbuilderutils.h"
 #include "tbus.h"
 #include "ctrl.h"
+#include "http.h"
 
 #define NUMBEROFINTERFACESWHENCONFIGURED 2
 
@@ -19,8 +20,10 @@ static const char* interfacename;
 struct network_interface *stainterface, *apinterface;
 
 static char* apinterfacename;
+static gchar* apname;
 
 static gboolean noapinterface;
+static gboolean nl80211scan;
 
 static NetworkWpaSupplicant* supplicant_sta;
 static NetworkWpaSupplicant* supplicant_ap;
@@ -33,15 +36,41 @@ static enum NETWORK_CONFIGURATION_STATE configurationstate = NTWKST_UNCONFIGURED
 static guint timeoutsource;
 static struct network_config* networkbeingconfigured;
 
-gboolean network_init(const char* interface, gboolean noap) {
+/* On boot the supplicant is pointed at the bss and channel it was last
+ * connected to so it doesn't have to scan every channel first. If that
+ * doesn't work out within this many seconds it goes back to full scans.
+ */
+#define FASTRECONNECT_TIMEOUT 5
+static guint fastreconnectsource;
+static int fastreconnectnetwork = -1;
+
+/* Scans take the radio off channel and disrupt the AP VIF so requests
+ * that arrive while a scan is running are merged into it and there is
+ * a minimum interval between scans hitting the radio.
+ */
+// after this long an in-flight scan is assumed to have been lost
+#define SCAN_TIMEOUT 10
+static guint scaninterval;
+static gboolean scaninflight = FALSE;
+static gint64 lastscantime = 0;
+
+gboolean network_init(const char* interface, gboolean noap,
+		guint minscaninterval, gboolean singlesupplicant) {
 	interfacename = interface;
 	noapinterface = noap;
+	scaninterval = minscaninterval;
+	network_wpasupplicant_setsingleprocess(singlesupplicant);
 
 	if (!network_nl80211_init())
 		goto err_nl80211init;
 
 	if (!network_rtnetlink_init())
 		goto err_rtnetlinkinit;
+
+	nl80211scan = network_scan_nl80211_init();
+	if (!nl80211scan)
+		g_message("can't dump scans from nl80211, "
+				"using wpa_supplicant's bss table instead");
 	return TRUE;
 
 	err_rtnetlinkinit:			//
@@ -50,7 +79,7 @@ gboolean network_init(const char* interface, gboolean noap) {
 }
 
 void network_cleanup() {
-
+	network_scan_nl80211_cleanup();
 }
 
 static gboolean network_filteroutotherphys_filter(gpointer key, gpointer value,
@@ -123,19 +152,145 @@ static void network_checkconfigurationstate() {
 	if (configurationstate == NTWKST_INPROGRESS) {
 		g_source_remove(timeoutsource);
 		configurationstate = NTWKST_CONFIGURED;
+		// the config owns it from here
 		config_onnetworkconfigured(networkbeingconfigured);
-		g_free(networkbeingconfigured);
+		networkbeingconfigured = NULL;
 		g_message("configuration complete");
 	}
 	ctrl_onnetworkstatechange();
+	http_onstatechange();
+}
+
+static void network_fastreconnect_finish(void) {
+	if (fastreconnectnetwork < 0)
+		return;
+	if (fastreconnectsource != 0) {
+		g_source_remove(fastreconnectsource);
+		fastreconnectsource = 0;
+	}
+	network_wpasupplicant_clearhints(supplicant_sta, fastreconnectnetwork);
+	fastreconnectnetwork = -1;
+}
+
+static gboolean network_fastreconnect_timeout(gpointer user_data) {
+	g_message("didn't reconnect to the last bss, scanning all channels");
+	fastreconnectsource = 0;
+	network_fastreconnect_finish();
+	return FALSE;
+}
+
+static void network_supplicant_ready(void) {
+	const struct config* cfg = config_getconfig();
+	if (cfg->ntwkcfg != NULL) {
+		int networkid = network_wpasupplicant_addnetwork(supplicant_sta,
+				cfg->ntwkcfg->ssid, cfg->ntwkcfg->psk,
+				cfg->ntwkcfg->haspmk ? cfg->ntwkcfg->pmk : NULL,
+				WPASUPPLICANT_NETWORKMODE_STA);
+		if (networkid >= 0 && cfg->ntwkcfg->lastfrequency != 0) {
+			g_message("trying %s on %d MHz first", cfg->ntwkcfg->lastbssid,
+					cfg->ntwkcfg->lastfrequency);
+			network_wpasupplicant_sethints(supplicant_sta, networkid,
+					cfg->ntwkcfg->lastbssid, cfg->ntwkcfg->lastfrequency);
+			fastreconnectnetwork = networkid;
+			fastreconnectsource = g_timeout_add_seconds(FASTRECONNECT_TIMEOUT,
+					network_fastreconnect_timeout, NULL);
+		}
+		if (networkid >= 0)
+			network_wpasupplicant_selectnetwork(supplicant_sta, networkid);
+	}
+	http_onstatechange();
 }
 
 static void network_supplicant_connected(void) {
 	g_message("sta supplicant has connected");
+	network_fastreconnect_finish();
 	network_checkconfigurationstate();
+
+	const gchar* bssid;
+	int frequency;
+	if (network_wpasupplicant_getbss(supplicant_sta, &bssid, &frequency))
+		config_onnetworkconnected(bssid, frequency);
 }
 static void network_supplicant_disconnected(void) {
 	g_message("state supplicant has disconnected");
+	http_onstatechange();
+}
+static void network_supplicant_error(void) {
+	http_onstatechange();
+}
+static void network_onscanresults(GArray* scanresults) {
+	scaninflight = FALSE;
+	http_onscanresults(scanresults);
+}
+static void network_supplicant_onscanresults(GArray* scanresults) {
+	network_onscanresults(scanresults);
+	if (scanresults != NULL)
+		g_array_unref(scanresults);
+}
+/* The kernel's results come with the raw IEs, the signal in mBm and how
+ * long ago each bss was seen so they are used when they can be. The
+ * supplicant's bss table is only asked when nl80211 can't be dumped.
+ */
+static void network_supplicant_scanresults(void) {
+	if (nl80211scan) {
+		GArray* scanresults = network_scan_nl80211_dump(stainterface->ifidx);
+		if (scanresults != NULL) {
+			network_supplicant_onscanresults(scanresults);
+			return;
+		}
+		g_message("nl80211 scan dump failed, using the supplicant's results");
+	}
+	network_wpasupplicant_getscanresults(supplicant_sta,
+			network_supplicant_onscanresults);
+}
+
+#ifdef DEVELOPMENT
+/* With --nonetwork there is no supplicant so the network model is stubbed
+ * out to let the http side be exercised, and benchmarked, on a development
+ * machine. Scans complete after a fixed delay with a canned set of results
+ * and every config is accepted and then forgotten so each POST takes the
+ * same path.
+ */
+// how long a stubbed scan takes in milliseconds
+#define STUB_SCANTIME 250
+
+static gboolean stubbed = FALSE;
+static GArray* stubscanresults = NULL;
+
+static const struct network_scanresult stubnetworks[] = { //
+		{ "02:00:00:00:00:01", 2412, -38, "thingy-home", NF_ESS
+				| NF_WPA2_PSK_CCMP }, //
+		{ "02:00:00:00:00:02", 2437, -61, "thingy-office", NF_ESS
+				| NF_WPA_PSK_CCMP_TKIP | NF_WPA2_PSK_CCMP_TKIP }, //
+		{ "02:00:00:00:00:03", 5180, -70, "thingy-office", NF_ESS
+				| NF_WPA2_PSK_CCMP }, //
+		{ "02:00:00:00:00:04", 2462, -83, "cafe", NF_ESS }, //
+		{ "02:00:00:00:00:05", 2412, -90, "printer", NF_ESS | NF_WPS
+				| NF_WEP } };
+
+void network_init_stub(guint minscaninterval) {
+	stubbed = TRUE;
+	scaninterval = minscaninterval;
+	stubscanresults = g_array_new(FALSE, FALSE,
+			sizeof(struct network_scanresult));
+	g_array_append_vals(stubscanresults, stubnetworks,
+			G_N_ELEMENTS(stubnetworks));
+}
+
+static gboolean network_stub_scancomplete(gpointer user_data) {
+	network_onscanresults(stubscanresults);
+	return FALSE;
+}
+#endif
+
+static gboolean network_startscan(void) {
+#ifdef DEVELOPMENT
+	if (stubbed) {
+		g_timeout_add(STUB_SCANTIME, network_stub_scancomplete, NULL);
+		return TRUE;
+	}
+#endif
+	return network_wpasupplicant_scan(supplicant_sta);
 }
 
 gboolean network_start() {
@@ -148,24 +303,29 @@ gboolean network_start() {
 	supplicant_sta = network_wpasupplicant_new(interfacename);
 	if (supplicant_sta == NULL)
 		goto err_startsupplicant;
+	g_signal_connect(supplicant_sta,
+			NETWORK_WPASUPPLICANT_SIGNAL "::" NETWORK_WPASUPPLICANT_DETAIL_READY,
+			network_supplicant_ready, NULL);
 	g_signal_connect(supplicant_sta,
 			NETWORK_WPASUPPLICANT_SIGNAL "::" NETWORK_WPASUPPLICANT_DETAIL_CONNECTED,
 			network_supplicant_connected, NULL);
 	g_signal_connect(supplicant_sta,
 			NETWORK_WPASUPPLICANT_SIGNAL "::" NETWORK_WPASUPPLICANT_DETAIL_DISCONNECTED,
 			network_supplicant_disconnected, NULL);
+	g_signal_connect(supplicant_sta,
+			NETWORK_WPASUPPLICANT_SIGNAL "::" NETWORK_WPASUPPLICANT_DETAIL_ERROR,
+			network_supplicant_error, NULL);
+	g_signal_connect(supplicant_sta,
+			NETWORK_WPASUPPLICANT_SIGNAL "::" NETWORK_WPASUPPLICANT_DETAIL_SCANRESULTS,
+			network_supplicant_scanresults, NULL);
 
 	network_dhcpclient_start(supplicant_sta, stainterface->ifidx, interfacename,
 			stainterface->mac);
 
+	// the network is added once the supplicant is ready
 	const struct config* cfg = config_getconfig();
-	if (cfg->ntwkcfg != NULL) {
-		int networkid = network_wpasupplicant_addnetwork(supplicant_sta,
-				cfg->ntwkcfg->ssid, cfg->ntwkcfg->psk,
-				WPASUPPLICANT_NETWORKMODE_STA);
-		network_wpasupplicant_selectnetwork(supplicant_sta, networkid);
+	if (cfg->ntwkcfg != NULL)
 		configurationstate = NTWKST_CONFIGURED;
-	}
 
 	ret = TRUE;
 
@@ -188,15 +348,32 @@ int network_waitforinterface() {
 }
 
 int network_stop() {
+	if (fastreconnectsource != 0) {
+		g_source_remove(fastreconnectsource);
+		fastreconnectsource = 0;
+	}
 	network_dhcpclient_stop();
 	network_wpasupplicant_stop(supplicant_sta);
 	return 0;
 }
 
-static const gchar thingyidstr[] = "thingymcconfig:0";
+static const gchar thingyidstr[] = NETWORK_THINGYIE;
 static const struct network_wpasupplicant_ie ies[] = { { .id = 0xDD, .payload =
 		(const guint8*) thingyidstr, .payloadlen = sizeof(thingyidstr) - 1 } };
 
+static void network_supplicant_ap_ready(void) {
+	network_wpasupplicant_seties(supplicant_ap, ies, G_N_ELEMENTS(ies));
+	int networkid = network_wpasupplicant_addnetwork(supplicant_ap, apname,
+			"reallysecurepassword", NULL,
+			WPASUPPLICANT_NETWORKMODE_AP);
+	if (networkid >= 0)
+		network_wpasupplicant_selectnetwork(supplicant_ap, networkid);
+}
+
+/* The supplicant for the AP is started, or the AP interface is added to the
+ * single supplicant, straight after the STA so they both come up at the
+ * same time.
+ */
 int network_startap(const gchar* nameprefix) {
 	if (noapinterface)
 		return 0;
@@ -204,7 +381,8 @@ int network_startap(const gchar* nameprefix) {
 	GString* namestr = g_string_new(nameprefix);
 	g_string_append_printf(namestr, "_%02x%02x%02x", apinterface->mac[3],
 			apinterface->mac[4], apinterface->mac[5]);
-	gchar* name = g_string_free(namestr, FALSE);
+	g_free(apname);
+	apname = g_string_free(namestr, FALSE);
 
 	network_rtnetlink_clearipv4addr(apinterface->ifidx);
 	rtnetlink_ipv4_addr_add(apinterface->ifidx, "10.0.0.1/29");
@@ -212,11 +390,9 @@ int network_startap(const gchar* nameprefix) {
 	if (supplicant_ap == NULL)
 		goto err_startsupp;
 
-	network_wpasupplicant_seties(supplicant_ap, ies, G_N_ELEMENTS(ies));
-	network_wpasupplicant_addnetwork(supplicant_ap, name,
-			"reallysecurepassword",
-			WPASUPPLICANT_NETWORKMODE_AP);
-	network_wpasupplicant_selectnetwork(supplicant_ap, 0);
+	g_signal_connect(supplicant_ap,
+			NETWORK_WPASUPPLICANT_SIGNAL "::" NETWORK_WPASUPPLICANT_DETAIL_READY,
+			network_supplicant_ap_ready, NULL);
 	network_dhcpserver_start(apinterface->ifidx, apinterfacename,
 			apinterface->mac);
 
@@ -230,10 +406,23 @@ int network_stopap() {
 	return 0;
 }
 
-GPtrArray* network_scan() {
-	network_wpasupplicant_scan(supplicant_sta);
-	GPtrArray* scanresults = network_wpasupplicant_getlastscanresults();
-	return scanresults;
+gboolean network_scan() {
+	gboolean ret = FALSE;
+	gint64 now = g_get_monotonic_time();
+	gint64 sincelastscan = now - lastscantime;
+	if (scaninflight && sincelastscan < (SCAN_TIMEOUT * G_USEC_PER_SEC)) {
+		g_message("scan already in progress, merging request");
+		ret = TRUE;
+	} else if (lastscantime != 0
+			&& sincelastscan < (scaninterval * G_USEC_PER_SEC)) {
+		g_message("last scan was %d seconds ago, not scanning",
+				(int ) (sincelastscan / G_USEC_PER_SEC));
+	} else if (network_startscan()) {
+		scaninflight = TRUE;
+		lastscantime = now;
+		ret = TRUE;
+	}
+	return ret;
 }
 
 static gboolean network_configure_timeout(gpointer data) {
@@ -245,14 +434,27 @@ gboolean network_configure(struct network_config* ntwkcfg) {
 	if (configurationstate != NTWKST_UNCONFIGURED)
 		return FALSE;
 
+#ifdef DEVELOPMENT
+	if (stubbed) {
+		g_free(ntwkcfg);
+		return TRUE;
+	}
+#endif
+
+	// done once here so the supplicant doesn't have to on every boot
+	if (!network_model_config_derivepmk(ntwkcfg))
+		return FALSE;
+
 	configurationstate = NTWKST_INPROGRESS;
+	http_onstatechange();
 
 	networkbeingconfigured = ntwkcfg;
 
 	int networkid = network_wpasupplicant_addnetwork(supplicant_sta,
-			ntwkcfg->ssid, ntwkcfg->psk,
+			ntwkcfg->ssid, NULL, ntwkcfg->pmk,
 			WPASUPPLICANT_NETWORKMODE_STA);
-	network_wpasupplicant_selectnetwork(supplicant_sta, networkid);
+	if (networkid >= 0)
+		network_wpasupplicant_selectnetwork(supplicant_sta, networkid);
 
 	timeoutsource = g_timeout_add(60 * 1000, network_configure_timeout,
 	NULL);
@@ -264,14 +466,29 @@ static const gchar* configstatestrings[] = { [NTWKST_UNCONFIGURED
 		] = "unconfigured", [NTWKST_INPROGRESS] = "inprogress",
 		[NTWKST_CONFIGURED] = "configured" };
 
-void network_dumpstatus(JsonBuilder* builder) {
-	JSONBUILDER_START_OBJECT(builder, "network");
-	JSONBUILDER_ADD_STRING(builder, "config_state",
+void network_dumpstatus(struct serialiser* serialiser) {
+	SERIALISER_START_OBJECT(serialiser, "network");
+	SERIALISER_ADD_STRING(serialiser, "config_state",
 			configstatestrings[configurationstate]);
-	network_wpasupplicant_dumpstate(supplicant_sta, builder);
-	json_builder_end_object(builder);
-	network_dhcp_dumpstatus(builder);
-	json_builder_end_object(builder);
+	if (supplicant_sta != NULL)
+		network_wpasupplicant_dumpstate(supplicant_sta, "supplicant",
+				serialiser);
+	if (supplicant_ap != NULL)
+		network_wpasupplicant_dumpstate(supplicant_ap, "ap_supplicant",
+				serialiser);
+	network_dhcp_dumpstatus(serialiser);
+	serialiser_endobject(serialiser);
+}
+
+void network_dumpdebug(struct serialiser* serialiser) {
+	SERIALISER_START_OBJECT(serialiser, "network");
+	if (supplicant_sta != NULL)
+		network_wpasupplicant_dumpdebug(supplicant_sta, "supplicant",
+				serialiser);
+	if (supplicant_ap != NULL)
+		network_wpasupplicant_dumpdebug(supplicant_ap, "ap_supplicant",
+				serialiser);
+	serialiser_endobject(serialiser);
 }
 
 gboolean network_ctrl_sendstate(GOutputStream* os) {
@@ -2,19 +2,26 @@
 
 #include <glib.h>
 
+#include "buildconfig.h"
 #include "network_model.h"
+#include "serialiser.h"
 
 struct network_status {
 	char ssid[NETWORK_SSIDSTORAGELEN];
 };
 
-gboolean network_init(const char* interface, gboolean noap);
+gboolean network_init(const char* interface, gboolean noap,
+		guint minscaninterval, gboolean singlesupplicant);
+#ifdef DEVELOPMENT
+void network_init_stub(guint minscaninterval);
+#endif
 int network_waitforinterface(void);
 gboolean network_start(void);
 int network_stop(void);
-GPtrArray* network_scan(void);
+gboolean network_scan(void);
 gboolean network_configure(struct network_config* ntwkcfg);
 int network_startap(const gchar* nameprefix);
 int network_stopap(void);
-void network_dumpstatus(JsonBuilder* builder);
+void network_dumpstatus(struct serialiser* serialiser);
+void network_dumpdebug(struct serialiser* serialiser);
 gboolean network_ctrl_sendstate(GOutputStream* os);
@@ -5,17 +5,20 @@
 #include "buildconfig.h"
 #include "network_dhcp.h"
 #include "network_dns.h"
-#include "jsonbuilderutils.h"
+#include "http.h"
+#include "serialiser.h"
 
 static Dhcp4Client* dhcp4client = NULL;
 static struct dhcp4_server_cntx* dhcp4servercntx;
 
 static void network_dhcpclient_supplicantconnected(void) {
 	dhcp4_client_resume(dhcp4client);
+	http_onstatechange();
 }
 
 static void network_dhcpclient_supplicantdisconnected(void) {
 	dhcp4_client_pause(dhcp4client);
+	http_onstatechange();
 }
 
 static void network_dhcpclient_lease(Dhcp4Client* client,
@@ -41,6 +44,8 @@ static void network_dhcpclient_lease(Dhcp4Client* client,
 
 	} else
 		network_rtnetlink_clearipv4addr(dhcp4_client_getifindx(dhcp4client));
+
+	http_onstatechange();
 }
 
 void network_dhcpclient_start(NetworkWpaSupplicant* supplicant, unsigned ifidx,
@@ -84,38 +89,36 @@ static gchar* dhcpcstatestrs[] = { [DHCP4CS_IDLE] = "idle", [DHCP4CS_DISCOVERING
 		] = "discovering", [DHCP4CS_REQUESTING ] = "requesting",
 		[DHCP4CS_CONFIGURED ] = "configured" };
 
-static void network_dhcp_dumpstatus_addip4addr(JsonBuilder* builder,
+static void network_dhcp_dumpstatus_addip4addr(struct serialiser* serialiser,
 		guint8* addr) {
-	GString* strstr = g_string_new(NULL);
-	g_string_printf(strstr, IP4_ADDRFMT, IP4_ARGS(addr));
-	gchar* str = g_string_free(strstr, FALSE);
-	json_builder_add_string_value(builder, str);
-	g_free(str);
+	gchar str[sizeof("255.255.255.255")];
+	g_snprintf(str, sizeof(str), IP4_ADDRFMT, IP4_ARGS(addr));
+	serialiser_string(serialiser, str);
 }
 
-void network_dhcp_dumpstatus(JsonBuilder* builder) {
+void network_dhcp_dumpstatus(struct serialiser* serialiser) {
 	if (dhcp4client != NULL) {
-		JSONBUILDER_START_OBJECT(builder, "dhcp4");
-		JSONBUILDER_ADD_STRING(builder, "state",
+		SERIALISER_START_OBJECT(serialiser, "dhcp4");
+		SERIALISER_ADD_STRING(serialiser, "state",
 				dhcpcstatestrs[dhcp4_client_getstate(dhcp4client)]);
 
 		struct dhcp4_client_lease* lease = dhcp4_client_getlease(dhcp4client);
 		if (lease != NULL) {
-			JSONBUILDER_START_OBJECT(builder, "lease");
-			json_builder_set_member_name(builder, "ip");
-			network_dhcp_dumpstatus_addip4addr(builder, lease->leasedip);
-			json_builder_set_member_name(builder, "subnetmask");
-			network_dhcp_dumpstatus_addip4addr(builder, lease->subnetmask);
-			json_builder_set_member_name(builder, "defaultgw");
-			network_dhcp_dumpstatus_addip4addr(builder, lease->defaultgw);
-			JSONBUILDER_START_ARRAY(builder, "nameservers");
+			SERIALISER_START_OBJECT(serialiser, "lease");
+			serialiser_member(serialiser, "ip");
+			network_dhcp_dumpstatus_addip4addr(serialiser, lease->leasedip);
+			serialiser_member(serialiser, "subnetmask");
+			network_dhcp_dumpstatus_addip4addr(serialiser, lease->subnetmask);
+			serialiser_member(serialiser, "defaultgw");
+			network_dhcp_dumpstatus_addip4addr(serialiser, lease->defaultgw);
+			SERIALISER_START_ARRAY(serialiser, "nameservers");
 			for (int i = 0; i < lease->numnameservers; i++) {
-				network_dhcp_dumpstatus_addip4addr(builder,
+				network_dhcp_dumpstatus_addip4addr(serialiser,
 						lease->nameservers[i]);
 			}
-			json_builder_end_array(builder);
-			json_builder_end_object(builder);
+			serialiser_endarray(serialiser);
+			serialiser_endobject(serialiser);
 		}
-		json_builder_end_object(builder);
+		serialiser_endobject(serialiser);
 	}
 }
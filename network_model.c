@@ -1,12 +1,46 @@
+#include <string.h>
 #include "network_model.h"
 
 #define SSID "ssid"
 #define PSK	"psk"
+#define PMK "pmk"
+#define LASTBSSID "last_bssid"
+#define LASTFREQUENCY "last_frequency"
+
+static void network_model_config_deserialiselast(JsonObject* rootobj,
+		struct network_config* ntwkcfg) {
+	if (!json_object_has_member(rootobj, LASTBSSID)
+			|| !json_object_has_member(rootobj, LASTFREQUENCY))
+		return;
+	const gchar* bssid = json_object_get_string_member(rootobj, LASTBSSID);
+	if (bssid == NULL || strlen(bssid) != sizeof(ntwkcfg->lastbssid) - 1)
+		return;
+	g_strlcpy(ntwkcfg->lastbssid, bssid, sizeof(ntwkcfg->lastbssid));
+	ntwkcfg->lastfrequency = json_object_get_int_member(rootobj,
+			LASTFREQUENCY);
+}
 
 struct network_config* network_model_config_deserialise(JsonNode* root) {
 	if (json_node_get_node_type(root) == JSON_NODE_OBJECT) {
 		JsonObject* rootobj = json_node_get_object(root);
 		if (json_object_has_member(rootobj, SSID)
+				&& json_object_has_member(rootobj, PMK)) {
+			struct network_config* ntwkcfg = g_malloc0(
+					sizeof(struct network_config));
+			const gchar* ssid = json_object_get_string_member(rootobj, SSID);
+			const gchar* pmk = json_object_get_string_member(rootobj, PMK);
+			g_strlcpy(ntwkcfg->ssid, ssid, sizeof(ntwkcfg->ssid));
+			if (!network_pmk_fromhex(pmk, ntwkcfg->pmk)) {
+				g_message("network config has a bad pmk");
+				g_free(ntwkcfg);
+				return NULL;
+			}
+			ntwkcfg->haspmk = TRUE;
+			network_model_config_deserialiselast(rootobj, ntwkcfg);
+			return ntwkcfg;
+		}
+		// configs saved before the pmk was stored
+		else if (json_object_has_member(rootobj, SSID)
 				&& json_object_has_member(rootobj, PSK)) {
 			struct network_config* ntwkcfg = g_malloc0(
 					sizeof(struct network_config));
@@ -24,11 +58,334 @@ struct network_config* network_model_config_deserialise(JsonNode* root) {
 }
 
 void network_model_config_serialise(struct network_config* config,
-		JsonBuilder* jsonbuilder) {
-	json_builder_begin_object(jsonbuilder);
-	json_builder_set_member_name(jsonbuilder, SSID);
-	json_builder_add_string_value(jsonbuilder, config->ssid);
-	json_builder_set_member_name(jsonbuilder, PSK);
-	json_builder_add_string_value(jsonbuilder, config->psk);
-	json_builder_end_object(jsonbuilder);
+		struct serialiser* serialiser) {
+	serialiser_beginobject(serialiser);
+	SERIALISER_ADD_STRING(serialiser, SSID, config->ssid);
+	if (config->haspmk) {
+		gchar pmk[(NETWORK_PMKLEN * 2) + 1];
+		network_pmk_tohex(config->pmk, pmk);
+		SERIALISER_ADD_STRING(serialiser, PMK, pmk);
+	} else
+		SERIALISER_ADD_STRING(serialiser, PSK, config->psk);
+	if (config->lastfrequency != 0) {
+		SERIALISER_ADD_STRING(serialiser, LASTBSSID, config->lastbssid);
+		SERIALISER_ADD_INT(serialiser, LASTFREQUENCY, config->lastfrequency);
+	}
+	serialiser_endobject(serialiser);
+}
+
+/* Works out the pmk from the passphrase, or takes the psk as is if it's
+ * already 64 hex digits, and then forgets the passphrase.
+ */
+gboolean network_model_config_derivepmk(struct network_config* config) {
+	if (config->haspmk)
+		return TRUE;
+	if (!network_pmk_fromhex(config->psk, config->pmk)) {
+		gsize psklen = strlen(config->psk);
+		if (psklen < 8 || psklen > 63) {
+			g_message("passphrase should be between 8 and 63 characters");
+			return FALSE;
+		}
+		network_pmk_derive(config->psk, config->ssid, config->pmk);
+	}
+	config->haspmk = TRUE;
+	memset(config->psk, 0, sizeof(config->psk));
+	return TRUE;
+}
+
+/* Incremental parser for the config that is posted by clients. Data is
+ * fed in as it arrives and goes straight into a struct network_config so
+ * nothing is buffered. Only a flat object is accepted, members other than
+ * the ones we care about are skipped as long as they aren't objects or
+ * arrays.
+ */
+
+enum network_model_configparser_state {
+	CPS_START,
+	CPS_KEYORCLOSE,
+	CPS_KEY,
+	CPS_KEYSTRING,
+	CPS_COLON,
+	CPS_VALUE,
+	CPS_STRING,
+	CPS_LITERAL,
+	CPS_COMMAORCLOSE,
+	CPS_DONE,
+	CPS_ERROR
+};
+
+#define CONFIGPARSER_KEYLEN 8
+
+#define CONFIGPARSER_HAVESSID (1 << 0)
+#define CONFIGPARSER_HAVEPSK  (1 << 1)
+
+struct network_model_configparser {
+	enum network_model_configparser_state state;
+	struct network_config* config;
+	unsigned fields;
+	// the key of the member currently being parsed
+	char key[CONFIGPARSER_KEYLEN + 1];
+	gsize keylen;
+	// where the current string is going, NULL if it's being discarded
+	char* target;
+	gsize targetlen;
+	gsize targetmax;
+	// escape handling
+	gboolean escaped;
+	int unicodedigits;
+	gunichar unicode;
+	gunichar highsurrogate;
+};
+
+struct network_model_configparser* network_model_configparser_new() {
+	struct network_model_configparser* parser = g_malloc0(sizeof(*parser));
+	parser->config = g_malloc0(sizeof(*parser->config));
+	parser->state = CPS_START;
+	return parser;
+}
+
+void network_model_configparser_free(struct network_model_configparser* parser) {
+	g_free(parser->config);
+	g_free(parser);
+}
+
+static gboolean network_model_configparser_put(
+		struct network_model_configparser* parser, const char* bytes,
+		gsize len) {
+	if (parser->state == CPS_KEYSTRING) {
+		// keys that are too long can't be anything we are interested in
+		for (gsize i = 0; i < len; i++) {
+			if (parser->keylen < CONFIGPARSER_KEYLEN)
+				parser->key[parser->keylen] = bytes[i];
+			parser->keylen++;
+		}
+		return TRUE;
+	}
+
+	if (parser->target == NULL)
+		return TRUE;
+	if (parser->targetlen + len > parser->targetmax) {
+		g_message("config value is too long");
+		return FALSE;
+	}
+	memcpy(parser->target + parser->targetlen, bytes, len);
+	parser->targetlen += len;
+	return TRUE;
+}
+
+static gboolean network_model_configparser_putunichar(
+		struct network_model_configparser* parser, gunichar c) {
+	if (c >= 0xd800 && c <= 0xdbff) {
+		parser->highsurrogate = c;
+		return TRUE;
+	} else if (c >= 0xdc00 && c <= 0xdfff) {
+		if (parser->highsurrogate == 0)
+			return FALSE;
+		c = 0x10000 + ((parser->highsurrogate - 0xd800) << 10) + (c - 0xdc00);
+		parser->highsurrogate = 0;
+	} else if (parser->highsurrogate != 0)
+		return FALSE;
+
+	char utf8[6];
+	gint utf8len = g_unichar_to_utf8(c, utf8);
+	return network_model_configparser_put(parser, utf8, utf8len);
+}
+
+static gboolean network_model_configparser_stringchar(
+		struct network_model_configparser* parser, char c) {
+	if (parser->unicodedigits > 0) {
+		int digit = g_ascii_xdigit_value(c);
+		if (digit < 0)
+			return FALSE;
+		parser->unicode = (parser->unicode << 4) | digit;
+		if (--parser->unicodedigits == 0)
+			return network_model_configparser_putunichar(parser,
+					parser->unicode);
+		return TRUE;
+	}
+
+	if (parser->escaped) {
+		parser->escaped = FALSE;
+		char unescaped;
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			unescaped = c;
+			break;
+		case 'b':
+			unescaped = '\b';
+			break;
+		case 'f':
+			unescaped = '\f';
+			break;
+		case 'n':
+			unescaped = '\n';
+			break;
+		case 'r':
+			unescaped = '\r';
+			break;
+		case 't':
+			unescaped = '\t';
+			break;
+		case 'u':
+			parser->unicodedigits = 4;
+			parser->unicode = 0;
+			return TRUE;
+		default:
+			return FALSE;
+		}
+		return network_model_configparser_put(parser, &unescaped, 1);
+	}
+
+	// a high surrogate must be followed by an escaped low surrogate
+	if (parser->highsurrogate != 0 && c != '\\')
+		return FALSE;
+
+	if (c == '\\') {
+		parser->escaped = TRUE;
+		return TRUE;
+	} else if ((guchar) c < 0x20)
+		return FALSE;
+
+	return network_model_configparser_put(parser, &c, 1);
+}
+
+static void network_model_configparser_starttarget(
+		struct network_model_configparser* parser) {
+	parser->target = NULL;
+	if (parser->keylen > CONFIGPARSER_KEYLEN)
+		return;
+	parser->key[parser->keylen] = '\0';
+	if (strcmp(parser->key, SSID) == 0) {
+		parser->target = parser->config->ssid;
+		parser->targetmax = sizeof(parser->config->ssid) - 1;
+		parser->fields |= CONFIGPARSER_HAVESSID;
+	} else if (strcmp(parser->key, PSK) == 0) {
+		parser->target = parser->config->psk;
+		parser->targetmax = sizeof(parser->config->psk) - 1;
+		parser->fields |= CONFIGPARSER_HAVEPSK;
+	}
+	parser->targetlen = 0;
+}
+
+static enum network_model_configparser_state network_model_configparser_char(
+		struct network_model_configparser* parser, char c) {
+	gboolean whitespace = g_ascii_isspace(c);
+
+	switch (parser->state) {
+	case CPS_START:
+		if (whitespace)
+			return CPS_START;
+		if (c == '{')
+			return CPS_KEYORCLOSE;
+		break;
+	case CPS_KEYORCLOSE:
+		if (whitespace)
+			return CPS_KEYORCLOSE;
+		if (c == '"') {
+			parser->keylen = 0;
+			return CPS_KEYSTRING;
+		} else if (c == '}')
+			return CPS_DONE;
+		break;
+	case CPS_KEYSTRING:
+		if (c == '"' && !parser->escaped && parser->unicodedigits == 0) {
+			if (parser->highsurrogate != 0)
+				break;
+			return CPS_COLON;
+		}
+		if (network_model_configparser_stringchar(parser, c))
+			return CPS_KEYSTRING;
+		break;
+	case CPS_COLON:
+		if (whitespace)
+			return CPS_COLON;
+		if (c == ':') {
+			network_model_configparser_starttarget(parser);
+			return CPS_VALUE;
+		}
+		break;
+	case CPS_VALUE:
+		if (whitespace)
+			return CPS_VALUE;
+		if (c == '"')
+			return CPS_STRING;
+		// the fields we want are strings
+		if (parser->target != NULL) {
+			g_message("config field %s should be a string", parser->key);
+			break;
+		}
+		if (g_ascii_isalnum(c) || c == '-')
+			return CPS_LITERAL;
+		break;
+	case CPS_STRING:
+		if (c == '"' && !parser->escaped && parser->unicodedigits == 0) {
+			if (parser->highsurrogate != 0)
+				break;
+			if (parser->target != NULL)
+				parser->target[parser->targetlen] = '\0';
+			return CPS_COMMAORCLOSE;
+		}
+		if (network_model_configparser_stringchar(parser, c))
+			return CPS_STRING;
+		break;
+	case CPS_LITERAL:
+		if (g_ascii_isalnum(c) || c == '-' || c == '+' || c == '.')
+			return CPS_LITERAL;
+		parser->state = CPS_COMMAORCLOSE;
+		return network_model_configparser_char(parser, c);
+	case CPS_COMMAORCLOSE:
+		if (whitespace)
+			return CPS_COMMAORCLOSE;
+		if (c == ',')
+			return CPS_KEY;
+		else if (c == '}')
+			return CPS_DONE;
+		break;
+	case CPS_KEY:
+		if (whitespace)
+			return CPS_KEY;
+		if (c == '"') {
+			parser->keylen = 0;
+			return CPS_KEYSTRING;
+		}
+		break;
+	case CPS_DONE:
+		if (whitespace)
+			return CPS_DONE;
+		break;
+	case CPS_ERROR:
+		break;
+	}
+
+	return CPS_ERROR;
+}
+
+gboolean network_model_configparser_feed(
+		struct network_model_configparser* parser, const char* data,
+		gsize len) {
+	for (gsize i = 0; i < len && parser->state != CPS_ERROR; i++)
+		parser->state = network_model_configparser_char(parser, data[i]);
+
+	if (parser->state == CPS_ERROR) {
+		g_message("failed to parse network config");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+struct network_config* network_model_configparser_finish(
+		struct network_model_configparser* parser) {
+	struct network_config* ntwkcfg = NULL;
+	if (parser->state != CPS_DONE)
+		g_message("network config is incomplete");
+	else if (parser->fields != (CONFIGPARSER_HAVESSID | CONFIGPARSER_HAVEPSK))
+		g_message("network config is missing required fields");
+	else {
+		ntwkcfg = parser->config;
+		parser->config = NULL;
+	}
+	network_model_configparser_free(parser);
+	return ntwkcfg;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <json-glib/json-glib.h>
+#include "serialiser.h"
+#include "network_pmk.h"
 
 #define NETWORK_SSIDSTORAGELEN 33
 #define NETWORK_PASSWORDSTORANGELEN 65
@@ -12,22 +14,44 @@ typedef enum {
 	NF_WPA_PSK_CCMP = 1 << 3, //
 	NF_WPA_PSK_CCMP_TKIP = 1 << 4, //
 	NF_WPA2_PSK_CCMP = 1 << 5, //
-	NF_WPA2_PSK_CCMP_TKIP = 1 << 6
+	NF_WPA2_PSK_CCMP_TKIP = 1 << 6, //
+	NF_THINGY = 1 << 7
 } network_flags;
 
+// payload of the vendor IE that the AP adds to its beacons
+#define NETWORK_THINGYIE "thingymcconfig:0"
+
 struct network_scanresult {
 	char bssid[18];
 	int frequency;
 	int rssi;
 	char ssid[NETWORK_SSIDSTORAGELEN];
 	unsigned flags;
+	// milliseconds since the bss was last seen, 0 if unknown
+	unsigned age;
 };
 
 struct network_config {
 	char ssid[NETWORK_SSIDSTORAGELEN];
+	// the passphrase is only kept until the pmk has been worked out
 	char psk[NETWORK_PASSWORDSTORANGELEN];
+	guint8 pmk[NETWORK_PMKLEN];
+	gboolean haspmk;
+	// where we last connected, lastfrequency is 0 if we never have
+	char lastbssid[18];
+	int lastfrequency;
 };
 
 struct network_config* network_model_config_deserialise(JsonNode* root);
+gboolean network_model_config_derivepmk(struct network_config* config);
+struct network_model_configparser;
+
+struct network_model_configparser* network_model_configparser_new(void);
+gboolean network_model_configparser_feed(
+		struct network_model_configparser* parser, const char* data,
+		gsize len);
+struct network_config* network_model_configparser_finish(
+		struct network_model_configparser* parser);
+void network_model_configparser_free(struct network_model_configparser* parser);
 void network_model_config_serialise(struct network_config* config,
-		JsonBuilder* jsonbuilder);
+		struct serialiser* serialiser);
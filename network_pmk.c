@@ -0,0 +1,66 @@
+/* WPA-PSK PMK derivation, PBKDF2-HMAC-SHA1 of the passphrase salted with
+ * the ssid, 4096 iterations and 256 bits of output. It's slow on purpose
+ * so it's done once when a network is configured and the result is what
+ * gets stored and handed to wpa_supplicant.
+ */
+
+#include <string.h>
+#include "network_pmk.h"
+
+#define PBKDF2_ITERATIONS	4096
+#define SHA1LEN				20
+
+void network_pmk_derive(const gchar* passphrase, const gchar* ssid,
+		guint8* pmk) {
+	guint8 u[SHA1LEN], t[SHA1LEN];
+	gsize len = SHA1LEN;
+
+	// every iteration is keyed with the passphrase so the key is only set up once
+	GHmac* keyed = g_hmac_new(G_CHECKSUM_SHA1, (const guchar*) passphrase,
+			strlen(passphrase));
+
+	for (guint32 block = 1; (block - 1) * SHA1LEN < NETWORK_PMKLEN; block++) {
+		guint8 blockindex[] = { block >> 24, block >> 16, block >> 8, block };
+		GHmac* hmac = g_hmac_copy(keyed);
+		g_hmac_update(hmac, (const guchar*) ssid, strlen(ssid));
+		g_hmac_update(hmac, blockindex, sizeof(blockindex));
+		g_hmac_get_digest(hmac, u, &len);
+		g_hmac_unref(hmac);
+		memcpy(t, u, SHA1LEN);
+
+		for (int i = 1; i < PBKDF2_ITERATIONS; i++) {
+			hmac = g_hmac_copy(keyed);
+			g_hmac_update(hmac, u, SHA1LEN);
+			g_hmac_get_digest(hmac, u, &len);
+			g_hmac_unref(hmac);
+			for (int j = 0; j < SHA1LEN; j++)
+				t[j] ^= u[j];
+		}
+
+		gsize offset = (block - 1) * SHA1LEN;
+		memcpy(pmk + offset, t, MIN(SHA1LEN, NETWORK_PMKLEN - offset));
+	}
+
+	g_hmac_unref(keyed);
+	memset(u, 0, sizeof(u));
+	memset(t, 0, sizeof(t));
+}
+
+gboolean network_pmk_fromhex(const gchar* hex, guint8* pmk) {
+	if (strlen(hex) != NETWORK_PMKLEN * 2)
+		return FALSE;
+	for (int i = 0; i < NETWORK_PMKLEN; i++) {
+		int high = g_ascii_xdigit_value(hex[i * 2]);
+		int low = g_ascii_xdigit_value(hex[(i * 2) + 1]);
+		if (high < 0 || low < 0)
+			return FALSE;
+		pmk[i] = (high << 4) | low;
+	}
+	return TRUE;
+}
+
+// hex needs to have space for NETWORK_PMKLEN * 2 + 1 chars
+void network_pmk_tohex(const guint8* pmk, gchar* hex) {
+	for (int i = 0; i < NETWORK_PMKLEN; i++)
+		g_snprintf(hex + (i * 2), 3, "%02x", pmk[i]);
+}
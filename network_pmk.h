@@ -0,0 +1,10 @@
+#pragma once
+
+#include <glib.h>
+
+#define NETWORK_PMKLEN 32
+
+void network_pmk_derive(const gchar* passphrase, const gchar* ssid,
+		guint8* pmk);
+gboolean network_pmk_fromhex(const gchar* hex, guint8* pmk);
+void network_pmk_tohex(const guint8* pmk, gchar* hex);
@@ -0,0 +1,259 @@
+/* Scan results straight from the kernel. Once wpa_supplicant reports that
+ * a scan has finished the BSS table is dumped with NL80211_CMD_GET_SCAN and
+ * each BSS is written into the next slot of the result array. The flags
+ * that wpa_supplicant would have worked out are taken from the raw IEs and
+ * BSSs that are running thingymcconfig are picked out by their vendor IE.
+ */
+
+#include <string.h>
+#include <linux/if_ether.h>
+#include <linux/nl80211.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include "network_scan_nl80211.h"
+
+#define IE_SSID		0
+#define IE_RSN		48
+#define IE_VENDOR	221
+
+#define CAPABILITY_ESS		1
+#define CAPABILITY_PRIVACY	(1 << 4)
+
+#define MS_TYPE_WPA	1
+#define MS_TYPE_WPS	4
+
+#define SUITE_TKIP	2
+#define SUITE_CCMP	4
+#define AKM_PSK		2
+#define AKM_PSK_SHA256	6
+
+static const guint8 oui_ieee80211[] = { 0x00, 0x0f, 0xac };
+static const guint8 oui_microsoft[] = { 0x00, 0x50, 0xf2 };
+static const gchar thingyidstr[] = NETWORK_THINGYIE;
+
+static struct nla_policy bsspolicy[NL80211_BSS_MAX + 1] = {
+		[NL80211_BSS_BSSID] = { .minlen = ETH_ALEN }, //
+		[NL80211_BSS_FREQUENCY] = { .type = NLA_U32 }, //
+		[NL80211_BSS_CAPABILITY] = { .type = NLA_U16 }, //
+		[NL80211_BSS_SIGNAL_MBM] = { .type = NLA_U32 }, //
+		[NL80211_BSS_SEEN_MS_AGO] = { .type = NLA_U32 } };
+
+static struct nl_sock* scansock = NULL;
+static int nl80211id;
+
+gboolean network_scan_nl80211_init() {
+	scansock = nl_socket_alloc();
+	if (scansock == NULL)
+		goto err_alloc;
+	if (genl_connect(scansock) != 0)
+		goto err_connect;
+	nl80211id = genl_ctrl_resolve(scansock, NL80211_GENL_NAME);
+	if (nl80211id < 0)
+		goto err_resolve;
+	return TRUE;
+
+	err_resolve: //
+	err_connect: //
+	nl_socket_free(scansock);
+	scansock = NULL;
+	err_alloc: //
+	return FALSE;
+}
+
+/* RSN IEs and WPA vendor IEs have the same layout after the version and
+ * group cipher; a list of pairwise ciphers and then a list of AKMs.
+ */
+static unsigned network_scan_nl80211_parsesuites(const guint8* oui,
+		const guint8* data, gsize len, unsigned ccmpflag,
+		unsigned ccmptkipflag) {
+	gboolean ccmp = FALSE, tkip = FALSE, psk = FALSE;
+
+	// version and group cipher
+	if (len < 2 + 4 + 2)
+		return 0;
+	data += 2 + 4;
+	len -= 2 + 4;
+
+	unsigned count = data[0] | (data[1] << 8);
+	data += 2;
+	len -= 2;
+	if (len < (count * 4) + 2)
+		return 0;
+	for (unsigned i = 0; i < count; i++, data += 4) {
+		if (memcmp(data, oui, 3) != 0)
+			continue;
+		if (data[3] == SUITE_CCMP)
+			ccmp = TRUE;
+		else if (data[3] == SUITE_TKIP)
+			tkip = TRUE;
+	}
+	len -= count * 4;
+
+	count = data[0] | (data[1] << 8);
+	data += 2;
+	len -= 2;
+	if (len < count * 4)
+		return 0;
+	for (unsigned i = 0; i < count; i++, data += 4) {
+		if (memcmp(data, oui, 3) == 0
+				&& (data[3] == AKM_PSK || data[3] == AKM_PSK_SHA256))
+			psk = TRUE;
+	}
+
+	if (!psk || !ccmp)
+		return 0;
+	return tkip ? ccmptkipflag : ccmpflag;
+}
+
+static void network_scan_nl80211_parsessid(struct network_scanresult* result,
+		const guint8* data, gsize len) {
+	if (len >= sizeof(result->ssid))
+		return;
+	// hidden networks send an empty ssid or one that is all nulls
+	for (gsize i = 0; i < len; i++) {
+		if (data[i] != 0) {
+			memcpy(result->ssid, data, len);
+			result->ssid[len] = '\0';
+			return;
+		}
+	}
+}
+
+/* Returns whether there was an RSN or WPA IE at all, networks that aren't
+ * PSK still have one so it's what tells them apart from WEP.
+ */
+static gboolean network_scan_nl80211_parseies(
+		struct network_scanresult* result, const guint8* ies, gsize len) {
+	gboolean wpa = FALSE;
+	while (len >= 2) {
+		guint8 id = ies[0];
+		guint8 ielen = ies[1];
+		const guint8* data = ies + 2;
+		if (ielen > len - 2)
+			break;
+
+		switch (id) {
+		case IE_SSID:
+			network_scan_nl80211_parsessid(result, data, ielen);
+			break;
+		case IE_RSN:
+			wpa = TRUE;
+			result->flags |= network_scan_nl80211_parsesuites(oui_ieee80211,
+					data, ielen, NF_WPA2_PSK_CCMP, NF_WPA2_PSK_CCMP_TKIP);
+			break;
+		case IE_VENDOR:
+			if (ielen >= sizeof(thingyidstr) - 1
+					&& memcmp(data, thingyidstr, sizeof(thingyidstr) - 1) == 0)
+				result->flags |= NF_THINGY;
+			else if (ielen >= 4 && memcmp(data, oui_microsoft, 3) == 0) {
+				if (data[3] == MS_TYPE_WPA) {
+					wpa = TRUE;
+					result->flags |= network_scan_nl80211_parsesuites(
+							oui_microsoft, data + 4, ielen - 4,
+							NF_WPA_PSK_CCMP, NF_WPA_PSK_CCMP_TKIP);
+				} else if (data[3] == MS_TYPE_WPS)
+					result->flags |= NF_WPS;
+			}
+			break;
+		}
+
+		ies += 2 + ielen;
+		len -= 2 + ielen;
+	}
+	return wpa;
+}
+
+static int network_scan_nl80211_onbss(struct nl_msg* msg, void* arg) {
+	GArray* scanresults = arg;
+	struct genlmsghdr* gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr* tb[NL80211_ATTR_MAX + 1];
+	struct nlattr* bss[NL80211_BSS_MAX + 1];
+
+	if (nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+			genlmsg_attrlen(gnlh, 0), NULL) != 0 || tb[NL80211_ATTR_BSS] == NULL)
+		return NL_SKIP;
+	if (nla_parse_nested(bss, NL80211_BSS_MAX, tb[NL80211_ATTR_BSS],
+			bsspolicy) != 0 || bss[NL80211_BSS_BSSID] == NULL)
+		return NL_SKIP;
+
+	g_array_set_size(scanresults, scanresults->len + 1);
+	struct network_scanresult* result = &g_array_index(scanresults,
+			struct network_scanresult, scanresults->len - 1);
+
+	const guint8* bssid = nla_data(bss[NL80211_BSS_BSSID]);
+	g_snprintf(result->bssid, sizeof(result->bssid),
+			"%02x:%02x:%02x:%02x:%02x:%02x", bssid[0], bssid[1], bssid[2],
+			bssid[3], bssid[4], bssid[5]);
+	if (bss[NL80211_BSS_FREQUENCY] != NULL)
+		result->frequency = nla_get_u32(bss[NL80211_BSS_FREQUENCY]);
+	// signal is in mBm, 100 * dBm
+	if (bss[NL80211_BSS_SIGNAL_MBM] != NULL)
+		result->rssi = ((gint32) nla_get_u32(bss[NL80211_BSS_SIGNAL_MBM]))
+				/ 100;
+	if (bss[NL80211_BSS_SEEN_MS_AGO] != NULL)
+		result->age = nla_get_u32(bss[NL80211_BSS_SEEN_MS_AGO]);
+
+	gboolean privacy = FALSE;
+	if (bss[NL80211_BSS_CAPABILITY] != NULL) {
+		guint16 capability = nla_get_u16(bss[NL80211_BSS_CAPABILITY]);
+		if (capability & CAPABILITY_ESS)
+			result->flags |= NF_ESS;
+		privacy = (capability & CAPABILITY_PRIVACY) != 0;
+	}
+
+	// probe response ies if there are any, otherwise beacon ies
+	struct nlattr* ies = bss[NL80211_BSS_INFORMATION_ELEMENTS];
+	if (ies == NULL)
+		ies = bss[NL80211_BSS_BEACON_IES];
+	gboolean wpa = FALSE;
+	if (ies != NULL)
+		wpa = network_scan_nl80211_parseies(result, nla_data(ies),
+				nla_len(ies));
+
+	// enterprise and sae networks have the privacy bit too but aren't wep
+	if (privacy && !wpa)
+		result->flags |= NF_WEP;
+
+	return NL_SKIP;
+}
+
+GArray* network_scan_nl80211_dump(unsigned ifidx) {
+	GArray* scanresults = NULL;
+
+	if (scansock == NULL)
+		goto err_nosock;
+
+	struct nl_msg* msg = nlmsg_alloc();
+	if (msg == NULL)
+		goto err_allocmsg;
+	if (genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, nl80211id, 0, NLM_F_DUMP,
+			NL80211_CMD_GET_SCAN, 0) == NULL
+			|| nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifidx) != 0)
+		goto err_buildmsg;
+
+	scanresults = g_array_new(FALSE, TRUE, sizeof(struct network_scanresult));
+	nl_socket_modify_cb(scansock, NL_CB_VALID, NL_CB_CUSTOM,
+			network_scan_nl80211_onbss, scanresults);
+
+	int err = nl_send_auto(scansock, msg);
+	if (err >= 0)
+		err = nl_recvmsgs_default(scansock);
+	if (err < 0) {
+		g_message("scan dump failed: %s", nl_geterror(err));
+		g_array_unref(scanresults);
+		scanresults = NULL;
+	}
+
+	err_buildmsg: //
+	nlmsg_free(msg);
+	err_allocmsg: //
+	err_nosock: //
+	return scanresults;
+}
+
+void network_scan_nl80211_cleanup() {
+	if (scansock != NULL) {
+		nl_socket_free(scansock);
+		scansock = NULL;
+	}
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <glib.h>
+#include "network_model.h"
+
+gboolean network_scan_nl80211_init(void);
+GArray* network_scan_nl80211_dump(unsigned ifidx);
+void network_scan_nl80211_cleanup(void);
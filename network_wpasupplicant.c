@@ -1,8 +1,12 @@
+#include <stdio.h>
+#include <sys/socket.h>
 #include "buildconfig.h"
 #include "network_wpasupplicant_priv.h"
+#include "network_wpasupplicant_scanresults.h"
+#include "network_wpasupplicant_bsstable.h"
+#include "network_pmk.h"
 #include "network_priv.h"
 #include "utils.h"
-#include "jsonbuilderutils.h"
 
 struct _NetworkWpaSupplicant {
 	GObject parent_instance;
@@ -10,7 +14,50 @@ struct _NetworkWpaSupplicant {
 	struct wpa_ctrl* wpa_event;
 	GPid pid;
 	gboolean connected;
+	// the bss we are associated with, filled in from STATUS after connecting
+	char bssid[18];
+	int frequency;
 	gchar* lasterror;
+	/* replies and events are read into these and they are grown to fit
+	 * the biggest seen so far. there are two because a command can be sent
+	 * from an event handler while the event is still being looked at.
+	 */
+	struct network_wpasupplicant_buffer replybuf;
+	struct network_wpasupplicant_buffer eventbuf;
+	GString* cmdbuf;
+	// commands that have been sent, oldest first, waiting for replies
+	GArray* pendingcommands;
+	guint commandtimeout;
+	guint replywatch;
+	guint eventwatch;
+	// handle -> struct network_wpasupplicant_network
+	GHashTable* networks;
+	int nexthandle;
+	// startup, retrying the connection until the control socket appears
+	gchar* interface;
+	gchar* socketpath;
+	guint connectsource;
+	guint connectdelay;
+	gint64 spawntime;
+	gint64 timetoready;
+	// from a network being selected to the CONNECTED event, microseconds
+	gint64 selecttime;
+	gint64 timetoassociate;
+	// event counters for the status
+	guint64 events;
+	guint64 eventwakeups;
+	guint64 unhandledevents;
+	gint64 eventwindow;
+	guint eventsinwindow;
+	guint eventspersecond;
+	guint peakeventspersecond;
+	struct network_wpasupplicant_eventstats eventstats[WPASUPPLICANT_MAXEVENTHANDLERS];
+	// every bss the supplicant knows about, see the bsstable
+	struct network_wpasupplicant_bsstable* bsstable;
+	guint bssresyncsource;
+	gboolean bssresyncing;
+	// ids of BSS-ADDED bsss that are waiting for their BSS query
+	GHashTable* pendingbss;
 };
 
 G_DEFINE_TYPE(NetworkWpaSupplicant, network_wpasupplicant, G_TYPE_OBJECT)
@@ -18,8 +65,35 @@ G_DEFINE_TYPE(NetworkWpaSupplicant, network_wpasupplicant, G_TYPE_OBJECT)
 static guint supplicantsignal;
 static GQuark detail_connected;
 static GQuark detail_disconnected;
+static GQuark detail_error;
+static GQuark detail_scanresults;
+static GQuark detail_ready;
+static GRegex* keyvalueregex;
+
+static void network_wpasupplicant_freenetwork(gpointer data) {
+	struct network_wpasupplicant_network* network = data;
+	g_free(network->ssid);
+	g_free(network->psk);
+	g_free(network);
+}
+
+static void network_wpasupplicant_finalize(GObject* object) {
+	NetworkWpaSupplicant* supplicant = NETWORK_WPASUPPLICANT(object);
+	g_free(supplicant->replybuf.data);
+	g_free(supplicant->eventbuf.data);
+	g_string_free(supplicant->cmdbuf, TRUE);
+	g_array_unref(supplicant->pendingcommands);
+	network_wpasupplicant_bsstable_free(supplicant->bsstable);
+	g_hash_table_unref(supplicant->pendingbss);
+	g_hash_table_unref(supplicant->networks);
+	g_free(supplicant->lasterror);
+	g_free(supplicant->interface);
+	g_free(supplicant->socketpath);
+	G_OBJECT_CLASS(network_wpasupplicant_parent_class)->finalize(object);
+}
 
 static void network_wpasupplicant_class_init(NetworkWpaSupplicantClass *klass) {
+	G_OBJECT_CLASS(klass)->finalize = network_wpasupplicant_finalize;
 	supplicantsignal = g_signal_newv(NETWORK_WPASUPPLICANT_SIGNAL,
 	NETWORK_TYPE_WPASUPPLICANT,
 			G_SIGNAL_RUN_LAST | G_SIGNAL_NO_HOOKS | G_SIGNAL_NO_RECURSE
@@ -29,151 +103,396 @@ static void network_wpasupplicant_class_init(NetworkWpaSupplicantClass *klass) {
 	NETWORK_WPASUPPLICANT_DETAIL_CONNECTED);
 	detail_disconnected = g_quark_from_string(
 	NETWORK_WPASUPPLICANT_DETAIL_DISCONNECTED);
+	detail_error = g_quark_from_string(NETWORK_WPASUPPLICANT_DETAIL_ERROR);
+	detail_scanresults = g_quark_from_string(
+	NETWORK_WPASUPPLICANT_DETAIL_SCANRESULTS);
+	detail_ready = g_quark_from_string(NETWORK_WPASUPPLICANT_DETAIL_READY);
+	keyvalueregex = g_regex_new(NETWORK_WPASUPPLICANT_REGEX_KEYVALUE,
+			G_REGEX_OPTIMIZE, 0, NULL);
+}
+
+// returns FALSE if needed is over the limit and won't fit
+static gboolean network_wpasupplicant_buffer_grow(
+		struct network_wpasupplicant_buffer* buffer, gsize needed) {
+	if (needed <= buffer->size)
+		return TRUE;
+	gsize size = MAX(buffer->size, WPASUPPLICANT_BUFFER_INITIAL);
+	while (size < needed)
+		size *= 2;
+	size = MIN(size, WPASUPPLICANT_BUFFER_MAX);
+	// space for a terminator after the biggest reply
+	buffer->data = g_realloc(buffer->data, size + 1);
+	buffer->size = size;
+	return needed <= size;
 }
 
 static void network_wpasupplicant_init(NetworkWpaSupplicant *self) {
+	network_wpasupplicant_buffer_grow(&self->replybuf,
+	WPASUPPLICANT_BUFFER_INITIAL);
+	network_wpasupplicant_buffer_grow(&self->eventbuf,
+	WPASUPPLICANT_BUFFER_INITIAL);
+	self->cmdbuf = g_string_sized_new(128);
+	self->pendingcommands = g_array_new(FALSE, FALSE,
+			sizeof(struct network_wpasupplicant_command));
+	self->bsstable = network_wpasupplicant_bsstable_new();
+	self->pendingbss = g_hash_table_new(g_direct_hash, g_direct_equal);
+	self->networks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, network_wpasupplicant_freenetwork);
 }
 
 #define ISOK(rsp) (strcmp(rsp, "OK") == 0)
+#define ISBUSY(rsp) (strcmp(rsp, "FAIL-BUSY") == 0)
+#define ISFAIL(rsp) (strncmp(rsp, "FAIL", 4) == 0)
 
-static GPtrArray* scanresults = NULL;
 static char* wpasupplicantsocketdir = "/tmp/thingy_sockets/";
 
-static gchar* network_wpasupplicant_docommand(struct wpa_ctrl* wpa_ctrl,
-		gsize* replylen, gboolean stripnewline, const char* command) {
-	*replylen = 1024;
-	char* reply = g_malloc0(*replylen + 1);
-	if (wpa_ctrl_request(wpa_ctrl, command, strlen(command), reply, replylen,
-	NULL) == 0) {
-		if (stripnewline) {
-			//kill the newline
-			reply[*replylen - 1] = '\0';
-			*replylen -= 1;
-		}
-#ifdef WSDEBUG
-		g_message("command: %s, response: %s", command, reply);
-#endif
+/* In single process mode one supplicant is started with only the global
+ * control interface and each interface is added to it with INTERFACE_ADD.
+ * The instances are then just handles for the interfaces. The global
+ * interface is driven with an instance of its own that doesn't listen for
+ * events.
+ */
+static gboolean singleprocess = FALSE;
+static NetworkWpaSupplicant* globalsupplicant = NULL;
+// interfaces waiting for the global interface to be ready
+static GSList* waitingforglobal = NULL;
 
-		return reply;
-	} else {
-		g_free(reply);
-		return NULL;
+static gboolean network_wpasupplicant_onreply(GIOChannel *source,
+		GIOCondition condition, gpointer data);
+
+/* Replies that turn up after their commands have been given up on would
+ * be matched to whatever is sent next so the control socket is thrown
+ * away along with anything still queued on it.
+ */
+static void network_wpasupplicant_reopenctrl(NetworkWpaSupplicant* supplicant) {
+	if (supplicant->replywatch != 0) {
+		g_source_remove(supplicant->replywatch);
+		supplicant->replywatch = 0;
 	}
+	if (supplicant->wpa_ctrl != NULL)
+		wpa_ctrl_close(supplicant->wpa_ctrl);
+
+	supplicant->wpa_ctrl = wpa_ctrl_open(supplicant->socketpath);
+	if (supplicant->wpa_ctrl == NULL) {
+		g_message("failed to reopen wpa_supplicant control socket");
+		return;
+	}
+	supplicant->replywatch = utils_addwatchforsocketfd(
+			wpa_ctrl_get_fd(supplicant->wpa_ctrl), G_IO_IN,
+			network_wpasupplicant_onreply, supplicant);
+}
+
+static gboolean network_wpasupplicant_commandtimeout(gpointer user_data) {
+	NetworkWpaSupplicant* supplicant = user_data;
+	supplicant->commandtimeout = 0;
+
+	/* once a reply has gone missing the ones after it can't be matched
+	 * so everything that is pending is failed.
+	 */
+	network_wpasupplicant_reopenctrl(supplicant);
+	GArray* pending = supplicant->pendingcommands;
+	g_message("wpa_supplicant didn't reply to %u commands", pending->len);
+	supplicant->pendingcommands = g_array_new(FALSE, FALSE,
+			sizeof(struct network_wpasupplicant_command));
+	for (guint i = 0; i < pending->len; i++) {
+		struct network_wpasupplicant_command* command = &g_array_index(
+				pending, struct network_wpasupplicant_command, i);
+		if (command->callback != NULL)
+			command->callback(supplicant, command->command, NULL, 0,
+					command->user_data);
+	}
+	g_array_unref(pending);
+	return FALSE;
 }
 
-static gchar* network_wpasupplicant_docommandf(struct wpa_ctrl* wpa_ctrl,
-		gsize* replylen, gboolean stripnewline, const char* format, ...) {
+/* Commands are sent straight away without waiting for the replies to
+ * earlier ones. The supplicant handles them one at a time and replies in
+ * the same order so replies are matched to the oldest pending command as
+ * they arrive on the control socket. The command passed to the callback
+ * is the format string, it's only for logging and doesn't contain any
+ * secrets. If the supplicant doesn't reply the callback gets a NULL reply.
+ */
+static gboolean network_wpasupplicant_queuecommand(
+		NetworkWpaSupplicant* supplicant, gboolean stripnewline,
+		network_wpasupplicant_commandcallback callback, gpointer user_data,
+		const char* format, ...) {
 	va_list fmtargs;
 	va_start(fmtargs, format);
-	GString* cmdstr = g_string_new(NULL);
-	g_string_vprintf(cmdstr, format, fmtargs);
-	gchar* cmd = g_string_free(cmdstr, FALSE);
+	g_string_vprintf(supplicant->cmdbuf, format, fmtargs);
 	va_end(fmtargs);
-	gchar* reply = network_wpasupplicant_docommand(wpa_ctrl, replylen,
-			stripnewline, cmd);
-	g_free(cmd);
-	return reply;
-}
-
-static unsigned network_wpasupplicant_getscanresults_flags(const char* flags) {
-	unsigned f = 0;
-	GRegex* flagregex = g_regex_new(MATCHFLAG, 0, 0, NULL);
-	GMatchInfo* flagsmatchinfo;
-	g_regex_match(flagregex, flags, 0, &flagsmatchinfo);
-	while (g_match_info_matches(flagsmatchinfo)) {
-		char* flag = g_match_info_fetch(flagsmatchinfo, 1);
-		if (strcmp(flag, FLAG_ESS) == 0)
-			f |= NF_ESS;
-		else if (strcmp(flag, FLAG_WPS) == 0)
-			f |= NF_WPS;
-		else if (strcmp(flag, FLAG_WEP) == 0)
-			f |= NF_WEP;
-		else if (strcmp(flag, FLAG_WPA_PSK_CCMP) == 0)
-			f |= NF_WPA_PSK_CCMP;
-		else if (strcmp(flag, FLAG_WPA_PSK_CCMP_TKIP) == 0)
-			f |= NF_WPA_PSK_CCMP_TKIP;
-		else if (strcmp(flag, FLAG_WPA2_PSK_CCMP) == 0)
-			f |= NF_WPA2_PSK_CCMP;
-		else if (strcmp(flag, FLAG_WPA2_PSK_CCMP_TKIP) == 0)
-			f |= NF_WPA2_PSK_CCMP_TKIP;
-		else
-			g_message("unhandled flag: %s", flag);
-		g_free(flag);
-		g_match_info_next(flagsmatchinfo, NULL);
+
+	if (supplicant->wpa_ctrl == NULL
+			|| send(wpa_ctrl_get_fd(supplicant->wpa_ctrl),
+					supplicant->cmdbuf->str, supplicant->cmdbuf->len, 0) < 0) {
+		g_message("failed to send %s to wpa_supplicant", format);
+		if (callback != NULL)
+			callback(supplicant, format, NULL, 0, user_data);
+		return FALSE;
 	}
-	g_match_info_free(flagsmatchinfo);
-	g_regex_unref(flagregex);
-	return f;
+
+	struct network_wpasupplicant_command command = { .command = format,
+			.stripnewline = stripnewline, .callback = callback, .user_data =
+					user_data };
+	g_array_append_val(supplicant->pendingcommands, command);
+	if (supplicant->commandtimeout == 0)
+		supplicant->commandtimeout = g_timeout_add_seconds(
+		WPASUPPLICANT_COMMAND_TIMEOUT, network_wpasupplicant_commandtimeout,
+				supplicant);
+	return TRUE;
 }
 
-static void network_wpasupplicant_freescanresult(gpointer data) {
-	g_free(data);
+static gboolean network_wpasupplicant_onreply(GIOChannel *source,
+		GIOCondition condition, gpointer data) {
+	NetworkWpaSupplicant* supplicant = data;
+	struct network_wpasupplicant_buffer* buffer = &supplicant->replybuf;
+	int fd = wpa_ctrl_get_fd(supplicant->wpa_ctrl);
+
+	// pipelined commands tend to complete together so take all the replies
+	for (;;) {
+		// peek at the size first so a big reply is never truncated
+		ssize_t replylen = recv(fd, NULL, 0,
+		MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+		if (replylen < 0)
+			break;
+		gsize fulllen = replylen;
+		gboolean fits = network_wpasupplicant_buffer_grow(buffer, fulllen);
+		replylen = recv(fd, buffer->data, buffer->size, MSG_DONTWAIT);
+		if (replylen < 0)
+			break;
+		gchar* reply = buffer->data;
+		reply[replylen] = '\0';
+
+		/* what was read is only part of the reply so it can't be used, the
+		 * command it was for is failed instead.
+		 */
+		if (!fits) {
+			g_message("dropping %"G_GSIZE_FORMAT" byte reply from "
+			"wpa_supplicant, it's too big", fulllen);
+			if (supplicant->pendingcommands->len == 0)
+				continue;
+			reply = NULL;
+			replylen = 0;
+		}
+
+		// unsolicited messages, shouldn't happen as this socket isn't attached
+		if (reply != NULL && replylen > 0 && reply[0] == '<')
+			continue;
+
+		if (supplicant->pendingcommands->len == 0) {
+			g_message("unexpected reply from wpa_supplicant: %s", reply);
+			continue;
+		}
+		struct network_wpasupplicant_command command = g_array_index(
+				supplicant->pendingcommands,
+				struct network_wpasupplicant_command, 0);
+		g_array_remove_index(supplicant->pendingcommands, 0);
+
+		if (command.stripnewline && reply != NULL && replylen > 0
+				&& reply[replylen - 1] == '\n')
+			reply[--replylen] = '\0';
+#ifdef WSDEBUG
+		g_message("command: %s, response: %s", command.command, reply);
+#endif
+		if (command.callback != NULL)
+			command.callback(supplicant, command.command, reply, replylen,
+					command.user_data);
+	}
+
+	if (supplicant->commandtimeout != 0) {
+		g_source_remove(supplicant->commandtimeout);
+		supplicant->commandtimeout = 0;
+	}
+	if (supplicant->pendingcommands->len > 0)
+		supplicant->commandtimeout = g_timeout_add_seconds(
+		WPASUPPLICANT_COMMAND_TIMEOUT, network_wpasupplicant_commandtimeout,
+				supplicant);
+	return TRUE;
 }
 
-static void network_wpasupplicant_getscanresults(
-		NetworkWpaSupplicant* supplicant, const gchar* event) {
-	if (scanresults != NULL)
-		g_ptr_array_unref(scanresults);
+static void network_wpasupplicant_expectok(NetworkWpaSupplicant* supplicant,
+		const gchar* command, const gchar* reply, gsize replylen,
+		gpointer user_data) {
+	if (reply == NULL || !ISOK(reply))
+		g_message("%s failed: %s", command,
+				reply != NULL ? reply : "no reply");
+}
 
-	scanresults = g_ptr_array_new_with_free_func(
-			network_wpasupplicant_freescanresult);
+static void network_wpasupplicant_eventhandler_scanresults(
+		NetworkWpaSupplicant* supplicant, const gchar* event) {
+	g_signal_emit(supplicant, supplicantsignal, detail_scanresults);
+}
 
-	size_t replylen;
-	char* reply = network_wpasupplicant_docommand(supplicant->wpa_ctrl,
-			&replylen, FALSE, "SCAN_RESULTS");
+/* Commands are answered in order so by the time the PING comes back every
+ * BSS query that was sent for the events before the scan finished has
+ * been answered and the table is up to date.
+ */
+static void network_wpasupplicant_getscanresults_onreply(
+		NetworkWpaSupplicant* supplicant, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data) {
+	network_wpasupplicant_scanresultscallback callback = user_data;
+	GArray* scanresults = NULL;
 	if (reply != NULL) {
-		//g_message("%s\n sr: %s", SCANRESULTREGEX, reply);
-		GRegex* networkregex = g_regex_new(SCANRESULTREGEX, 0, 0, NULL);
-		GMatchInfo* matchinfo;
-		g_regex_match(networkregex, reply, 0, &matchinfo);
-		while (g_match_info_matches(matchinfo)) {
-			//char* line = g_match_info_fetch(matchinfo, 0);
-			//g_message("l %s", line);
-
-			char* bssid = g_match_info_fetch(matchinfo, 1);
-
-			char* frequencystr = g_match_info_fetch(matchinfo, 2);
-			int frequency = g_ascii_strtoll(frequencystr, NULL, 10);
-			char* rssistr = g_match_info_fetch(matchinfo, 3);
-			int rssi = g_ascii_strtoll(rssistr, NULL, 10);
-			char* flags = g_match_info_fetch(matchinfo, 4);
-			char* ssid = g_match_info_fetch(matchinfo, 5);
-
-			struct network_scanresult* n = g_malloc0(
-					sizeof(struct network_scanresult));
-			strncpy(n->bssid, bssid, sizeof(n->bssid));
-			n->frequency = frequency;
-			n->rssi = rssi;
-			n->flags = network_wpasupplicant_getscanresults_flags(flags);
-			strncpy(n->ssid, ssid, sizeof(n->ssid));
-			g_ptr_array_add(scanresults, n);
-
-			g_free(bssid);
-			g_free(frequencystr);
-			g_free(rssistr);
-			g_free(flags);
-			g_free(ssid);
-
+		scanresults = network_wpasupplicant_bsstable_snapshot(
+				supplicant->bsstable, g_get_monotonic_time(),
+				WPASUPPLICANT_BSS_MAXAGE * G_USEC_PER_SEC);
 #ifdef WSDEBUG
+		for (guint i = 0; i < scanresults->len; i++) {
+			struct network_scanresult* n = &g_array_index(scanresults,
+					struct network_scanresult, i);
 			g_message("bssid %s, frequency %d, rssi %d, flags %u, ssid %s",
 					n->bssid, n->frequency, n->rssi, n->flags, n->ssid);
-#endif
-			g_match_info_next(matchinfo, NULL);
 		}
-		g_match_info_free(matchinfo);
-		g_regex_unref(networkregex);
+#endif
 	}
+	callback(scanresults);
+}
+
+void network_wpasupplicant_getscanresults(NetworkWpaSupplicant* supplicant,
+		network_wpasupplicant_scanresultscallback callback) {
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_getscanresults_onreply, callback, "PING");
+}
+
+static void network_wpasupplicant_bss_onreply(NetworkWpaSupplicant* supplicant,
+		const gchar* command, const gchar* reply, gsize replylen,
+		gpointer user_data) {
+	// BSS-REMOVED was handled while the query was waiting for its reply
+	if (!g_hash_table_remove(supplicant->pendingbss, user_data))
+		return;
+	// empty if the bss was removed again before the query got there
+	if (reply == NULL || replylen == 0 || ISFAIL(reply))
+		return;
+	GArray* scanresults = network_wpasupplicant_scanresults_parsebss(reply,
+			replylen, NULL);
+	network_wpasupplicant_bsstable_update(supplicant->bsstable, scanresults,
+			g_get_monotonic_time());
+	g_array_unref(scanresults);
+}
+
+// <3>CTRL-EVENT-BSS-ADDED 34 02:00:00:00:00:01
+static gboolean network_wpasupplicant_parsebssevent(const gchar* event,
+		unsigned* id, gchar* bssid) {
+	const gchar* args = strchr(event, ' ');
+	return args != NULL && sscanf(args, " %u %17s", id, bssid) == 2;
+}
+
+static void network_wpasupplicant_eventhandler_bssadded(
+		NetworkWpaSupplicant* supplicant, const gchar* event) {
+	unsigned id;
+	gchar bssid[18];
+	if (!network_wpasupplicant_parsebssevent(event, &id, bssid))
+		return;
+	g_hash_table_add(supplicant->pendingbss, GUINT_TO_POINTER(id));
+	network_wpasupplicant_queuecommand(supplicant, FALSE,
+			network_wpasupplicant_bss_onreply, GUINT_TO_POINTER(id),
+			"BSS ID-%u MASK=0x%x", id, WPASUPPLICANT_BSS_MASK);
+}
+
+static void network_wpasupplicant_eventhandler_bssremoved(
+		NetworkWpaSupplicant* supplicant, const gchar* event) {
+	unsigned id;
+	gchar bssid[18];
+	if (!network_wpasupplicant_parsebssevent(event, &id, bssid))
+		return;
+	g_hash_table_remove(supplicant->pendingbss, GUINT_TO_POINTER(id));
+	network_wpasupplicant_bsstable_remove(supplicant->bsstable, bssid);
+}
+
+/* Replies are limited to a few KiB so BSS RANGE= stops at the last BSS
+ * that fits. The resync carries on from the one after that until a reply
+ * comes back empty.
+ */
+static void network_wpasupplicant_bssresync_onreply(
+		NetworkWpaSupplicant* supplicant, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data) {
+	if (reply == NULL || ISFAIL(reply)) {
+		g_message("bss resync failed: %s", reply != NULL ? reply : "no reply");
+		network_wpasupplicant_bsstable_abortresync(supplicant->bsstable);
+		supplicant->bssresyncing = FALSE;
+		return;
+	}
+
+	int lastid = -1;
+	GArray* scanresults = network_wpasupplicant_scanresults_parsebss(reply,
+			replylen, &lastid);
+	network_wpasupplicant_bsstable_resync(supplicant->bsstable, scanresults,
+			g_get_monotonic_time());
+	g_array_unref(scanresults);
+
+	if (lastid >= 0) {
+		network_wpasupplicant_queuecommand(supplicant, FALSE,
+				network_wpasupplicant_bssresync_onreply, NULL,
+				"BSS RANGE=%d- MASK=0x%x", lastid + 1, WPASUPPLICANT_BSS_MASK);
+		return;
+	}
+
+	guint removed = network_wpasupplicant_bsstable_endresync(
+			supplicant->bsstable);
+	removed += network_wpasupplicant_bsstable_expire(supplicant->bsstable,
+			g_get_monotonic_time(), WPASUPPLICANT_BSS_MAXAGE * G_USEC_PER_SEC);
+	if (removed > 0)
+		g_message("dropped %u stale bss from the table", removed);
+	supplicant->bssresyncing = FALSE;
+}
+
+static gboolean network_wpasupplicant_bssresync(gpointer user_data) {
+	NetworkWpaSupplicant* supplicant = user_data;
+	if (supplicant->bssresyncing)
+		return TRUE;
+	supplicant->bssresyncing = TRUE;
+	network_wpasupplicant_bsstable_beginresync(supplicant->bsstable);
+	network_wpasupplicant_queuecommand(supplicant, FALSE,
+			network_wpasupplicant_bssresync_onreply, NULL,
+			"BSS RANGE=ALL MASK=0x%x", WPASUPPLICANT_BSS_MASK);
+	return TRUE;
+}
+
+/* The connected event only has the bssid so STATUS is asked for the
+ * frequency too and connected is signalled once the reply is in.
+ */
+static void network_wpasupplicant_status_onreply(
+		NetworkWpaSupplicant* supplicant, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data) {
+	// disconnected before the reply came back
+	if (!supplicant->connected)
+		return;
+
+	if (reply != NULL) {
+		gchar** lines = g_strsplit(reply, "\n", 0);
+		for (gchar** line = lines; *line != NULL; line++) {
+			if (g_str_has_prefix(*line, "bssid="))
+				g_strlcpy(supplicant->bssid, *line + strlen("bssid="),
+						sizeof(supplicant->bssid));
+			else if (g_str_has_prefix(*line, "freq="))
+				supplicant->frequency = g_ascii_strtoll(
+						*line + strlen("freq="), NULL, 10);
+		}
+		g_strfreev(lines);
+	} else
+		g_message("couldn't get the status after connecting");
+
+	g_signal_emit(supplicant, supplicantsignal, detail_connected);
 }
 
 static void network_wpasupplicant_eventhandler_connect(
 		NetworkWpaSupplicant* supplicant, const gchar* event) {
 	supplicant->connected = TRUE;
-	g_signal_emit(supplicant, supplicantsignal, detail_connected);
+	if (supplicant->selecttime != 0) {
+		supplicant->timetoassociate = g_get_monotonic_time()
+				- supplicant->selecttime;
+		supplicant->selecttime = 0;
+		g_message("associated %d ms after the network was selected",
+				(int) (supplicant->timetoassociate / 1000));
+	}
+	network_wpasupplicant_queuecommand(supplicant, FALSE,
+			network_wpasupplicant_status_onreply, NULL, "STATUS");
 }
 
 static void network_wpasupplicant_eventhandler_disconnect(
 		NetworkWpaSupplicant* supplicant, const gchar* event) {
 	supplicant->connected = FALSE;
+	supplicant->bssid[0] = '\0';
+	supplicant->frequency = 0;
 	g_signal_emit(supplicant, supplicantsignal, detail_disconnected);
 }
 
@@ -181,8 +500,6 @@ static GHashTable* network_wpasupplicant_getkeyvalues(const gchar* event) {
 	GHashTable* result = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
 			g_free);
 
-	GRegex* keyvalueregex = g_regex_new(NETWORK_WPASUPPLICANT_REGEX_KEYVALUE, 0,
-			0, NULL);
 	GMatchInfo* matchinfo;
 	if (g_regex_match(keyvalueregex, event, 0, &matchinfo)) {
 		do {
@@ -202,69 +519,132 @@ static GHashTable* network_wpasupplicant_getkeyvalues(const gchar* event) {
 static void network_wpasupplicant_eventhandler_ssiddisabled(
 		NetworkWpaSupplicant* supplicant, const gchar* event) {
 	//<3>CTRL-EVENT-SSID-TEMP-DISABLED id=0 ssid="ghettonet" auth_failures=2 duration=23 reason=WRONG_KEY
-	g_message("here");
 	GHashTable* keyvalues = network_wpasupplicant_getkeyvalues(event);
 	gchar* reason = g_hash_table_lookup(keyvalues, "reason");
 	if (supplicant->lasterror != NULL)
 		g_free(supplicant->lasterror);
 	supplicant->lasterror = g_strdup(reason);
 	g_hash_table_unref(keyvalues);
+	g_signal_emit(supplicant, supplicantsignal, detail_error);
 }
 
-static const struct wpaeventhandler_entry eventhandlers[] = { {
-WPA_EVENT_SCAN_RESULTS, network_wpasupplicant_getscanresults }, {
-WPA_EVENT_CONNECTED, network_wpasupplicant_eventhandler_connect }, {
-WPA_EVENT_DISCONNECTED, network_wpasupplicant_eventhandler_disconnect }, {
-WPA_EVENT_TEMP_DISABLED, network_wpasupplicant_eventhandler_ssiddisabled } };
+static const struct wpaeventhandler_entry eventhandlers[] = {
+		WPAEVENTHANDLER(WPA_EVENT_SCAN_RESULTS, "scanresults",
+				network_wpasupplicant_eventhandler_scanresults),
+		WPAEVENTHANDLER(WPA_EVENT_CONNECTED, "connected",
+				network_wpasupplicant_eventhandler_connect),
+		WPAEVENTHANDLER(WPA_EVENT_DISCONNECTED, "disconnected",
+				network_wpasupplicant_eventhandler_disconnect),
+		WPAEVENTHANDLER(WPA_EVENT_TEMP_DISABLED, "ssiddisabled",
+				network_wpasupplicant_eventhandler_ssiddisabled),
+		WPAEVENTHANDLER(WPA_EVENT_BSS_ADDED, "bssadded",
+				network_wpasupplicant_eventhandler_bssadded),
+		WPAEVENTHANDLER(WPA_EVENT_BSS_REMOVED, "bssremoved",
+				network_wpasupplicant_eventhandler_bssremoved) };
+
+G_STATIC_ASSERT(G_N_ELEMENTS(eventhandlers) <= WPASUPPLICANT_MAXEVENTHANDLERS);
+
+/* events per second are counted in one second windows, the rate is the
+ * count from the last complete window.
+ */
+static void network_wpasupplicant_countevent(NetworkWpaSupplicant* supplicant,
+		gint64 now) {
+	gint64 sincewindow = now - supplicant->eventwindow;
+	if (sincewindow >= G_USEC_PER_SEC) {
+		supplicant->eventspersecond =
+				sincewindow < 2 * G_USEC_PER_SEC ?
+						supplicant->eventsinwindow : 0;
+		supplicant->eventwindow = now;
+		supplicant->eventsinwindow = 0;
+	}
+	supplicant->events++;
+	supplicant->eventsinwindow++;
+	if (supplicant->eventsinwindow > supplicant->peakeventspersecond)
+		supplicant->peakeventspersecond = supplicant->eventsinwindow;
+}
+
+static guint network_wpasupplicant_eventrate(NetworkWpaSupplicant* supplicant) {
+	gint64 sincewindow = g_get_monotonic_time() - supplicant->eventwindow;
+	if (sincewindow >= 2 * G_USEC_PER_SEC)
+		return 0;
+	else if (sincewindow >= G_USEC_PER_SEC)
+		return supplicant->eventsinwindow;
+	return supplicant->eventspersecond;
+}
+
+static void network_wpasupplicant_dispatchevent(
+		NetworkWpaSupplicant* supplicant, const gchar* event) {
+	// <level>EVENT-NAME ...
+	if (event[0] != '<' || event[1] < '0' || event[1] > '4' || event[2] != '>')
+		return;
+	const gchar* command = event + 3;
+
+	gint64 start = g_get_monotonic_time();
+	network_wpasupplicant_countevent(supplicant, start);
+
+	for (int i = 0; i < G_N_ELEMENTS(eventhandlers); i++) {
+		if (strncmp(command, eventhandlers[i].command,
+				eventhandlers[i].commandlen) == 0) {
+			eventhandlers[i].handler(supplicant, event);
+			struct network_wpasupplicant_eventstats* stats =
+					&supplicant->eventstats[i];
+			stats->count++;
+			stats->time += g_get_monotonic_time() - start;
+			return;
+		}
+	}
+
+	supplicant->unhandledevents++;
+	g_message("unhandled event %.*s", (int ) strcspn(command, " "), command);
+}
 
 static gboolean network_wpasupplicant_onevent(GIOChannel *source,
 		GIOCondition condition, gpointer data) {
 	NetworkWpaSupplicant* supplicant = data;
-	size_t replylen = 1024;
-	char* reply = g_malloc0(replylen + 1);
-	wpa_ctrl_recv(supplicant->wpa_event, reply, &replylen);
+	struct network_wpasupplicant_buffer* buffer = &supplicant->eventbuf;
+	int fd = wpa_ctrl_get_fd(supplicant->wpa_event);
 
-#ifdef WSDEBUG
-	g_message("event for wpa supplicant(%d): %s", supplicant->pid, reply);
-#endif
+	supplicant->eventwakeups++;
 
-	GRegex* regex = g_regex_new("^<([0-4])>([A-Z,-]* )", 0, 0, NULL);
-	GMatchInfo* matchinfo;
-	if (g_regex_match(regex, reply, 0, &matchinfo)) {
-		char* level = g_match_info_fetch(matchinfo, 1);
-		char* command = g_match_info_fetch(matchinfo, 2);
+	/* scans and roaming produce bursts of events so take everything that
+	 * is waiting, up to a limit so the rest of the main loop isn't held up.
+	 * anything left over wakes us up again.
+	 */
+	for (int i = 0; i < WPASUPPLICANT_EVENT_BATCH; i++) {
+		/* events can't be asked for again so the size of the next one is
+		 * peeked at first to make sure it will fit.
+		 */
+		ssize_t eventlen = recv(fd, NULL, 0,
+		MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+		if (eventlen < 0)
+			break;
+		gsize fulllen = eventlen;
+		gboolean fits = network_wpasupplicant_buffer_grow(buffer, fulllen);
+		eventlen = recv(fd, buffer->data, buffer->size, MSG_DONTWAIT);
+		if (eventlen < 0)
+			break;
+		if (!fits) {
+			g_message("dropping %"G_GSIZE_FORMAT" byte event from "
+			"wpa_supplicant, it's too big", fulllen);
+			continue;
+		}
+		gchar* event = buffer->data;
+		event[eventlen] = '\0';
 
 #ifdef WSDEBUG
-		g_message("level: %s, command \"%s\"", level, command);
+		g_message("event for wpa supplicant(%d): %s", supplicant->pid, event);
 #endif
 
-		gboolean handled = FALSE;
-		for (int i = 0; i < G_N_ELEMENTS(eventhandlers); i++) {
-			if (strcmp(command, eventhandlers[i].command) == 0) {
-				eventhandlers[i].handler(supplicant, reply);
-				handled = TRUE;
-				break;
-			}
-		}
-
-		if (!handled)
-			g_message("unhandled event %s", command);
-
-		g_free(level);
-		g_free(command);
-
+		network_wpasupplicant_dispatchevent(supplicant, event);
 	}
-	g_match_info_free(matchinfo);
-	g_regex_unref(regex);
 
-	g_free(reply);
 	return TRUE;
 }
 
 void network_wpasupplicant_seties(NetworkWpaSupplicant* supplicant,
 		const struct network_wpasupplicant_ie* ies, unsigned numies) {
 	if (numies > 0) {
-		GString* iedatastr = g_string_new("SET ap_vendor_elements ");
+		GString* iedatastr = g_string_new(NULL);
 		for (int i = 0; i < numies; i++) {
 			g_string_append_printf(iedatastr, "%02x%02x", (unsigned) ies->id,
 					(unsigned) ies->payloadlen);
@@ -275,134 +655,454 @@ void network_wpasupplicant_seties(NetworkWpaSupplicant* supplicant,
 			}
 			ies++;
 		}
-		gchar* iedatacmd = g_string_free(iedatastr, FALSE);
-		gsize replylen;
-		network_wpasupplicant_docommand(supplicant->wpa_ctrl, &replylen, TRUE,
-				iedatacmd);
-		g_free(iedatacmd);
+		network_wpasupplicant_queuecommand(supplicant, TRUE,
+				network_wpasupplicant_expectok, NULL,
+				"SET ap_vendor_elements %s", iedatastr->str);
+		g_string_free(iedatastr, TRUE);
 	}
 }
 
-void network_wpasupplicant_scan(NetworkWpaSupplicant* supplicant) {
-	size_t replylen;
-	char* reply = network_wpasupplicant_docommand(supplicant->wpa_ctrl,
-			&replylen,
-			TRUE, "SCAN");
-	if (reply != NULL) {
-		g_free(reply);
-	}
+static void network_wpasupplicant_scan_onreply(
+		NetworkWpaSupplicant* supplicant, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data) {
+	// busy means the supplicant is already scanning, results will follow
+	if (reply != NULL && (ISOK(reply) || ISBUSY(reply)))
+		return;
+	/* nothing is going to report that the scan finished so pretend it did,
+	 * whatever is already known will be returned to anyone waiting.
+	 */
+	g_message("scan failed: %s", reply != NULL ? reply : "no reply");
+	g_signal_emit(supplicant, supplicantsignal, detail_scanresults);
 }
 
-int network_wpasupplicant_addnetwork(NetworkWpaSupplicant* supplicant,
-		const gchar* ssid, const gchar* psk, unsigned mode) {
-	g_message("adding network %s with psk %s", ssid, psk);
-	gsize respsz;
-	gchar* resp = network_wpasupplicant_docommand(supplicant->wpa_ctrl, &respsz,
-	TRUE, "ADD_NETWORK");
+gboolean network_wpasupplicant_scan(NetworkWpaSupplicant* supplicant) {
+	return network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_scan_onreply, NULL, "SCAN");
+}
+
+static void network_wpasupplicant_queuehints(NetworkWpaSupplicant* supplicant,
+		int networkid, const gchar* bssid, int frequency) {
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL,
+			"SET_NETWORK %d bssid_hint %s", networkid, bssid);
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL, "SET_NETWORK %d scan_freq %d",
+			networkid, frequency);
+}
+
+/* Once the supplicant has said which id the network got everything that
+ * was asked for in the meantime is sent.
+ */
+static void network_wpasupplicant_addnetwork_onreply(
+		NetworkWpaSupplicant* supplicant, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data) {
+	struct network_wpasupplicant_network* network = g_hash_table_lookup(
+			supplicant->networks, user_data);
+	if (network == NULL)
+		return;
+
 	guint64 networkid;
-	if (resp != NULL) {
-		if (!g_ascii_string_to_unsigned(resp, 10, 0, G_MAXUINT8, &networkid,
-		NULL)) {
-			g_message("failed to parse network id, command failed?");
-			return -1;
-		}
-		g_free(resp);
+	if (reply == NULL
+			|| !g_ascii_string_to_unsigned(reply, 10, 0, G_MAXUINT8,
+					&networkid, NULL)) {
+		g_message("failed to parse network id, command failed?");
+		network->failed = TRUE;
+		return;
 	}
+	network->id = networkid;
 
-	resp = network_wpasupplicant_docommandf(supplicant->wpa_ctrl, &respsz, TRUE,
-			"SET_NETWORK %u ssid \"%s\"", (unsigned) networkid, ssid);
-	if (resp != NULL) {
-		g_assert(ISOK(resp));
-		g_free(resp);
-	}
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL, "SET_NETWORK %d ssid \"%s\"",
+			network->id, network->ssid);
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL, "SET_NETWORK %d psk %s",
+			network->id, network->psk);
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL, "SET_NETWORK %d mode %u",
+			network->id, network->mode);
+	if (network->hintfrequency != 0)
+		network_wpasupplicant_queuehints(supplicant, network->id,
+				network->hintbssid, network->hintfrequency);
+	if (network->selected)
+		network_wpasupplicant_queuecommand(supplicant, TRUE,
+				network_wpasupplicant_expectok, NULL, "SELECT_NETWORK %d",
+				network->id);
+}
 
-	resp = network_wpasupplicant_docommandf(supplicant->wpa_ctrl, &respsz, TRUE,
-			"SET_NETWORK %u psk \"%s\"", (unsigned) networkid, psk);
-	if (resp != NULL) {
-		g_assert(ISOK(resp));
-		g_free(resp);
+/* What is asked for is always recorded in the network, it's only sent
+ * straight away if the supplicant has already said which id it has.
+ */
+static struct network_wpasupplicant_network* network_wpasupplicant_getnetwork(
+		NetworkWpaSupplicant* supplicant, int handle) {
+	struct network_wpasupplicant_network* network = g_hash_table_lookup(
+			supplicant->networks, GINT_TO_POINTER(handle));
+	if (network == NULL || network->failed) {
+		g_message("network %d was never added", handle);
+		return NULL;
 	}
+	return network;
+}
+
+/* Nothing is sent for the network until ADD_NETWORK has been answered so
+ * nothing can end up going to the wrong id. The value returned is a handle
+ * for the network to pass to the calls below, not the supplicant's id.
+ *
+ * If the pmk is passed it's used as is and the psk is ignored, otherwise
+ * the supplicant has to work the pmk out from the psk itself.
+ */
+int network_wpasupplicant_addnetwork(NetworkWpaSupplicant* supplicant,
+		const gchar* ssid, const gchar* psk, const guint8* pmk, unsigned mode) {
+	g_message("adding network %s", ssid);
+	struct network_wpasupplicant_network* network = g_malloc0(
+			sizeof(*network));
+	network->handle = supplicant->nexthandle++;
+	network->id = -1;
+	network->ssid = g_strdup(ssid);
+	if (pmk != NULL) {
+		gchar pmkhex[(NETWORK_PMKLEN * 2) + 1];
+		network_pmk_tohex(pmk, pmkhex);
+		network->psk = g_strdup(pmkhex);
+	} else
+		network->psk = g_strdup_printf("\"%s\"", psk);
+	network->mode = mode;
+	g_hash_table_insert(supplicant->networks,
+			GINT_TO_POINTER(network->handle), network);
 
-	resp = network_wpasupplicant_docommandf(supplicant->wpa_ctrl, &respsz, TRUE,
-			"SET_NETWORK %u mode %d", (unsigned) networkid, mode);
-	if (resp != NULL) {
-		g_assert(ISOK(resp));
-		g_free(resp);
+	if (!network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_addnetwork_onreply,
+			GINT_TO_POINTER(network->handle), "ADD_NETWORK")) {
+		g_hash_table_remove(supplicant->networks,
+				GINT_TO_POINTER(network->handle));
+		return -1;
 	}
-	return networkid;
+	return network->handle;
 }
 
 void network_wpasupplicant_selectnetwork(NetworkWpaSupplicant* supplicant,
 		int which) {
-	gsize respsz;
-	gchar* resp = network_wpasupplicant_docommandf(supplicant->wpa_ctrl,
-			&respsz, TRUE, "SELECT_NETWORK %d", which);
-	if (resp != NULL)
-		g_free(resp);
+	struct network_wpasupplicant_network* network =
+			network_wpasupplicant_getnetwork(supplicant, which);
+	if (network == NULL)
+		return;
+	network->selected = TRUE;
+	// timed from here so waiting for ADD_NETWORK is included
+	supplicant->selecttime = g_get_monotonic_time();
+	if (network->id == -1)
+		return;
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL, "SELECT_NETWORK %d",
+			network->id);
 }
 
-NetworkWpaSupplicant* network_wpasupplicant_new(const char* interface) {
-	NetworkWpaSupplicant* supplicant = g_object_new(NETWORK_TYPE_WPASUPPLICANT,
-	NULL);
+/* Points the supplicant at the bss it was last connected to. scan_freq
+ * limits the scans for the network to that one channel and bssid_hint
+ * keeps preferring the old bss so both have to be cleared again once we
+ * are connected or have given up on it.
+ */
+void network_wpasupplicant_sethints(NetworkWpaSupplicant* supplicant,
+		int networkid, const gchar* bssid, int frequency) {
+	struct network_wpasupplicant_network* network =
+			network_wpasupplicant_getnetwork(supplicant, networkid);
+	if (network == NULL)
+		return;
+	g_strlcpy(network->hintbssid, bssid, sizeof(network->hintbssid));
+	network->hintfrequency = frequency;
+	if (network->id == -1)
+		return;
+	network_wpasupplicant_queuehints(supplicant, network->id, bssid,
+			frequency);
+}
 
-	g_message("starting wpa_supplicant for %s", interface);
-	gchar* args[] = { WPASUPPLICANT_BINARYPATH, "-Dnl80211", "-i", interface,
-			"-C", wpasupplicantsocketdir, "-qq", NULL };
-	if (!g_spawn_async(NULL, args, NULL,
-			G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL, NULL,
-			NULL, &supplicant->pid, NULL)) {
-		g_message("failed to start wpa_supplicant");
-		goto err_spawn;
-	} else
-		g_message("wpa_supplicant for %s started, pid %d", interface,
-				supplicant->pid);
+void network_wpasupplicant_clearhints(NetworkWpaSupplicant* supplicant,
+		int networkid) {
+	struct network_wpasupplicant_network* network =
+			network_wpasupplicant_getnetwork(supplicant, networkid);
+	if (network == NULL)
+		return;
+	network->hintbssid[0] = '\0';
+	network->hintfrequency = 0;
+	if (network->id == -1)
+		return;
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL,
+			"SET_NETWORK %d bssid_hint any", network->id);
+	// an empty list, the first 0 ends it, removes scan_freq
+	network_wpasupplicant_queuecommand(supplicant, TRUE,
+			network_wpasupplicant_expectok, NULL, "SET_NETWORK %d scan_freq 0",
+			network->id);
+}
 
-	g_usleep(2 * 1000000);
+gboolean network_wpasupplicant_getbss(NetworkWpaSupplicant* supplicant,
+		const gchar** bssid, int* frequency) {
+	if (!supplicant->connected || supplicant->frequency == 0
+			|| supplicant->bssid[0] == '\0')
+		return FALSE;
+	*bssid = supplicant->bssid;
+	*frequency = supplicant->frequency;
+	return TRUE;
+}
+
+static void network_wpasupplicant_global_ready(void);
+static void network_wpasupplicant_global_failed(void);
 
-	GString* socketpathstr = g_string_new(NULL);
-	g_string_printf(socketpathstr, "%s/%s", wpasupplicantsocketdir, interface);
-	gchar* socketpath = g_string_free(socketpathstr, FALSE);
+static void network_wpasupplicant_startupfailed(
+		NetworkWpaSupplicant* supplicant) {
+	g_free(supplicant->lasterror);
+	supplicant->lasterror = g_strdup("wpa_supplicant didn't start");
+	g_signal_emit(supplicant, supplicantsignal, detail_error);
+}
+
+/* The control socket only appears once the supplicant has set the
+ * interface up so connecting is retried, backing off a bit each time,
+ * until it works or the supplicant is given up on.
+ */
+static gboolean network_wpasupplicant_connect(gpointer user_data) {
+	NetworkWpaSupplicant* supplicant = user_data;
+	supplicant->connectsource = 0;
 
-	supplicant->wpa_ctrl = wpa_ctrl_open(socketpath);
-	if (supplicant->wpa_ctrl)
-		g_message("wpa_supplicant control socket connected");
-	else {
-		g_message("failed to open wpa_supplicant control socket");
-		goto err_openctrlsck;
+	supplicant->wpa_ctrl = wpa_ctrl_open(supplicant->socketpath);
+	if (supplicant->wpa_ctrl == NULL) {
+		if (g_get_monotonic_time() - supplicant->spawntime
+				> WPASUPPLICANT_STARTUP_TIMEOUT * G_USEC_PER_SEC) {
+			g_message("wpa_supplicant control socket for %s didn't appear",
+					supplicant->interface);
+			goto err_timeout;
+		}
+		supplicant->connectdelay = MIN(supplicant->connectdelay * 2,
+				WPASUPPLICANT_CONNECT_MAXDELAY);
+		supplicant->connectsource = g_timeout_add(supplicant->connectdelay,
+				network_wpasupplicant_connect, supplicant);
+		return FALSE;
 	}
+	g_message("wpa_supplicant control socket connected");
+	supplicant->replywatch = utils_addwatchforsocketfd(
+			wpa_ctrl_get_fd(supplicant->wpa_ctrl), G_IO_IN,
+			network_wpasupplicant_onreply, supplicant);
 
-	supplicant->wpa_event = wpa_ctrl_open(socketpath);
+	if (supplicant == globalsupplicant) {
+		network_wpasupplicant_global_ready();
+		return FALSE;
+	}
+
+	supplicant->wpa_event = wpa_ctrl_open(supplicant->socketpath);
 	if (supplicant->wpa_event) {
 		g_message("wpa_supplicant event socket connected");
 		wpa_ctrl_attach(supplicant->wpa_event);
 		int fd = wpa_ctrl_get_fd(supplicant->wpa_event);
-		utils_addwatchforsocketfd(fd, G_IO_IN, network_wpasupplicant_onevent,
-				supplicant);
+		supplicant->eventwatch = utils_addwatchforsocketfd(fd, G_IO_IN,
+				network_wpasupplicant_onevent, supplicant);
 	} else {
 		g_message("failed to open wpa_supplicant event socket");
 		goto err_openevntsck;
 	}
 
-	return supplicant;
+	supplicant->timetoready = g_get_monotonic_time() - supplicant->spawntime;
+	g_message("wpa_supplicant for %s ready after %d ms", supplicant->interface,
+			(int) (supplicant->timetoready / 1000));
+	supplicant->bssresyncsource = g_timeout_add_seconds(
+	WPASUPPLICANT_BSS_RESYNC, network_wpasupplicant_bssresync, supplicant);
+	g_signal_emit(supplicant, supplicantsignal, detail_ready);
+	return FALSE;
 
 	err_openevntsck:	//
+	g_source_remove(supplicant->replywatch);
+	supplicant->replywatch = 0;
 	wpa_ctrl_close(supplicant->wpa_ctrl);
-	err_openctrlsck:	//
-	g_free(socketpath);
+	supplicant->wpa_ctrl = NULL;
+	err_timeout:		//
+	if (supplicant == globalsupplicant)
+		network_wpasupplicant_global_failed();
+	else
+		network_wpasupplicant_startupfailed(supplicant);
+	return FALSE;
+}
+
+static gboolean network_wpasupplicant_spawn(NetworkWpaSupplicant* supplicant,
+		gchar** args) {
+	if (!g_spawn_async(NULL, args, NULL,
+			G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL, NULL,
+			NULL, &supplicant->pid, NULL)) {
+		g_message("failed to start wpa_supplicant");
+		return FALSE;
+	}
+	g_message("wpa_supplicant for %s started, pid %d", supplicant->interface,
+			supplicant->pid);
+
+	supplicant->connectdelay = WPASUPPLICANT_CONNECT_FIRSTDELAY;
+	supplicant->connectsource = g_timeout_add(supplicant->connectdelay,
+			network_wpasupplicant_connect, supplicant);
+	return TRUE;
+}
+
+static void network_wpasupplicant_global_interfaceadded(
+		NetworkWpaSupplicant* global, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data) {
+	NetworkWpaSupplicant* supplicant = user_data;
+	if (reply == NULL || !ISOK(reply)) {
+		g_message("failed to add %s to wpa_supplicant: %s",
+				supplicant->interface, reply != NULL ? reply : "no reply");
+		network_wpasupplicant_startupfailed(supplicant);
+		return;
+	}
+	// the control socket for the interface should be there already
+	supplicant->connectdelay = WPASUPPLICANT_CONNECT_FIRSTDELAY;
+	network_wpasupplicant_connect(supplicant);
+}
+
+static void network_wpasupplicant_global_addinterface(
+		NetworkWpaSupplicant* supplicant) {
+	supplicant->pid = globalsupplicant->pid;
+	// ifname, confname, driver, ctrl_interface
+	network_wpasupplicant_queuecommand(globalsupplicant, TRUE,
+			network_wpasupplicant_global_interfaceadded, supplicant,
+			"INTERFACE_ADD %s\t\tnl80211\t%s", supplicant->interface,
+			wpasupplicantsocketdir);
+}
+
+static void network_wpasupplicant_global_ready() {
+	g_message("wpa_supplicant global interface ready after %d ms",
+			(int) ((g_get_monotonic_time() - globalsupplicant->spawntime)
+					/ 1000));
+	for (GSList* w = waitingforglobal; w != NULL; w = w->next)
+		network_wpasupplicant_global_addinterface(w->data);
+	g_slist_free(waitingforglobal);
+	waitingforglobal = NULL;
+}
+
+static void network_wpasupplicant_global_failed() {
+	for (GSList* w = waitingforglobal; w != NULL; w = w->next)
+		network_wpasupplicant_startupfailed(w->data);
+	g_slist_free(waitingforglobal);
+	waitingforglobal = NULL;
+}
+
+static gboolean network_wpasupplicant_global_start() {
+	globalsupplicant = g_object_new(NETWORK_TYPE_WPASUPPLICANT, NULL);
+	globalsupplicant->interface = g_strdup("global");
+	globalsupplicant->socketpath = g_strdup_printf("%s/global",
+			wpasupplicantsocketdir);
+	globalsupplicant->spawntime = g_get_monotonic_time();
+
+	// -g doesn't create the directory like -C does
+	g_mkdir_with_parents(wpasupplicantsocketdir, 0700);
+	gchar* args[] = { WPASUPPLICANT_BINARYPATH, "-g",
+			globalsupplicant->socketpath, "-qq", NULL };
+	if (!network_wpasupplicant_spawn(globalsupplicant, args)) {
+		g_object_unref(globalsupplicant);
+		globalsupplicant = NULL;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void network_wpasupplicant_setsingleprocess(gboolean single) {
+	singleprocess = single;
+}
+
+/* Returns as soon as the supplicant has been spawned, or in single process
+ * mode as soon as the interface has been queued to be added, the ready
+ * detail is emitted once the sockets are connected and commands can be
+ * sent.
+ */
+NetworkWpaSupplicant* network_wpasupplicant_new(const char* interface) {
+	NetworkWpaSupplicant* supplicant = g_object_new(NETWORK_TYPE_WPASUPPLICANT,
+	NULL);
+	supplicant->spawntime = g_get_monotonic_time();
+	supplicant->interface = g_strdup(interface);
+	supplicant->socketpath = g_strdup_printf("%s/%s", wpasupplicantsocketdir,
+			interface);
+
+	if (singleprocess) {
+		g_message("adding %s to wpa_supplicant", interface);
+		if (globalsupplicant == NULL && !network_wpasupplicant_global_start())
+			goto err_spawn;
+		if (globalsupplicant->wpa_ctrl != NULL)
+			network_wpasupplicant_global_addinterface(supplicant);
+		else
+			waitingforglobal = g_slist_append(waitingforglobal, supplicant);
+	} else {
+		g_message("starting wpa_supplicant for %s", interface);
+		gchar* args[] = { WPASUPPLICANT_BINARYPATH, "-Dnl80211", "-i",
+				(gchar*) interface, "-C", wpasupplicantsocketdir, "-qq", NULL };
+		if (!network_wpasupplicant_spawn(supplicant, args))
+			goto err_spawn;
+	}
+
+	return supplicant;
+
 	err_spawn:			//
+	g_object_unref(supplicant);
 	return NULL;
 }
 
-GPtrArray* network_wpasupplicant_getlastscanresults() {
-	return scanresults;
+// resident memory of a supplicant process in kB, -1 if it can't be read
+static gint64 network_wpasupplicant_getrss(GPid pid) {
+	gint64 rss = -1;
+	gchar* path = g_strdup_printf("/proc/%d/status", pid);
+	gchar* status;
+	if (g_file_get_contents(path, &status, NULL, NULL)) {
+		gchar* vmrss = strstr(status, "VmRSS:");
+		if (vmrss != NULL)
+			rss = g_ascii_strtoll(vmrss + strlen("VmRSS:"), NULL, 10);
+		g_free(status);
+	}
+	g_free(path);
+	return rss;
 }
 
 void network_wpasupplicant_dumpstate(NetworkWpaSupplicant* supplicant,
-		JsonBuilder* builder) {
-	JSONBUILDER_START_OBJECT(builder, "supplicant");
-	JSONBUILDER_ADD_BOOL(builder, "connected", supplicant->connected);
+		const gchar* name, struct serialiser* serialiser) {
+	SERIALISER_START_OBJECT(serialiser, name);
+	SERIALISER_ADD_BOOL(serialiser, "connected", supplicant->connected);
+	if (supplicant->connected && supplicant->frequency != 0) {
+		SERIALISER_ADD_STRING(serialiser, "bssid", supplicant->bssid);
+		SERIALISER_ADD_INT(serialiser, "frequency", supplicant->frequency);
+	}
+	if (supplicant->timetoready != 0)
+		SERIALISER_ADD_INT(serialiser, "startup_ms",
+				supplicant->timetoready / 1000);
+	if (supplicant->timetoassociate != 0)
+		SERIALISER_ADD_INT(serialiser, "associate_ms",
+				supplicant->timetoassociate / 1000);
 	if (supplicant->lasterror)
-		JSONBUILDER_ADD_STRING(builder, "lasterror", supplicant->lasterror);
+		SERIALISER_ADD_STRING(serialiser, "lasterror", supplicant->lasterror);
+	serialiser_endobject(serialiser);
+}
+
+/* These change all the time without the state changing so they can't go
+ * in the status, which is only rendered again when the state changes.
+ */
+void network_wpasupplicant_dumpdebug(NetworkWpaSupplicant* supplicant,
+		const gchar* name, struct serialiser* serialiser) {
+	SERIALISER_START_OBJECT(serialiser, name);
+	// in single process mode every interface reports the same process
+	gint64 rss = network_wpasupplicant_getrss(supplicant->pid);
+	if (rss >= 0)
+		SERIALISER_ADD_INT(serialiser, "rss_kb", rss);
+	SERIALISER_ADD_INT(serialiser, "bss",
+			network_wpasupplicant_bsstable_size(supplicant->bsstable));
+
+	SERIALISER_START_OBJECT(serialiser, "events");
+	SERIALISER_ADD_INT(serialiser, "total", supplicant->events);
+	SERIALISER_ADD_INT(serialiser, "wakeups", supplicant->eventwakeups);
+	SERIALISER_ADD_INT(serialiser, "unhandled", supplicant->unhandledevents);
+	SERIALISER_ADD_INT(serialiser, "per_sec",
+			network_wpasupplicant_eventrate(supplicant));
+	SERIALISER_ADD_INT(serialiser, "peak_per_sec",
+			supplicant->peakeventspersecond);
+	for (int i = 0; i < G_N_ELEMENTS(eventhandlers); i++) {
+		struct network_wpasupplicant_eventstats* stats =
+				&supplicant->eventstats[i];
+		if (stats->count == 0)
+			continue;
+		SERIALISER_START_OBJECT(serialiser, eventhandlers[i].name);
+		SERIALISER_ADD_INT(serialiser, "count", stats->count);
+		SERIALISER_ADD_INT(serialiser, "time_us", stats->time);
+		serialiser_endobject(serialiser);
+	}
+	serialiser_endobject(serialiser);
+
+	serialiser_endobject(serialiser);
 }
 
 void network_wpasupplicant_ctrl_fill(NetworkWpaSupplicant* supplicant,
@@ -417,6 +1117,18 @@ void network_wpasupplicant_ctrl_fill(NetworkWpaSupplicant* supplicant,
 }
 
 void network_wpasupplicant_stop(NetworkWpaSupplicant* supplicant) {
-	wpa_ctrl_close(supplicant->wpa_ctrl);
-	wpa_ctrl_close(supplicant->wpa_event);
+	guint* sources[] = { &supplicant->connectsource, &supplicant->replywatch,
+			&supplicant->eventwatch, &supplicant->commandtimeout,
+			&supplicant->bssresyncsource };
+	for (int i = 0; i < G_N_ELEMENTS(sources); i++) {
+		if (*sources[i] != 0) {
+			g_source_remove(*sources[i]);
+			*sources[i] = 0;
+		}
+	}
+	// not there if the supplicant never became ready
+	if (supplicant->wpa_ctrl != NULL)
+		wpa_ctrl_close(supplicant->wpa_ctrl);
+	if (supplicant->wpa_event != NULL)
+		wpa_ctrl_close(supplicant->wpa_event);
 }
@@ -1,8 +1,9 @@
 #pragma once
 
-#include <json-glib/json-glib.h>
+#include <glib-object.h>
 #include <wpa_ctrl.h>
 #include "network_model.h"
+#include "serialiser.h"
 #include "tbus.h"
 
 G_BEGIN_DECLS
@@ -16,14 +17,6 @@ G_END_DECLS
 #define WPASUPPLICANT_NETWORKMODE_STA	0
 #define WPASUPPLICANT_NETWORKMODE_AP	2
 
-#define FLAG_ESS "ESS"
-#define FLAG_WPS "WPS"
-#define FLAG_WEP "WEP"
-#define FLAG_WPA_PSK_CCMP "WPA-PSK-CCMP"
-#define FLAG_WPA_PSK_CCMP_TKIP "WPA-PSK-CCMP+TKIP"
-#define FLAG_WPA2_PSK_CCMP "WPA2-PSK-CCMP"
-#define FLAG_WPA2_PSK_CCMP_TKIP "WPA2-PSK-CCMP+TKIP"
-
 struct network_wpasupplicant_ie {
 	guint8 id;
 	const guint8* payload;
@@ -33,18 +26,33 @@ struct network_wpasupplicant_ie {
 #define NETWORK_WPASUPPLICANT_SIGNAL              "wpasupplicant"
 #define NETWORK_WPASUPPLICANT_DETAIL_CONNECTED    "connected"
 #define NETWORK_WPASUPPLICANT_DETAIL_DISCONNECTED "disconnected"
+#define NETWORK_WPASUPPLICANT_DETAIL_ERROR        "error"
+#define NETWORK_WPASUPPLICANT_DETAIL_SCANRESULTS  "scanresults"
+#define NETWORK_WPASUPPLICANT_DETAIL_READY        "ready"
+
+typedef void (*network_wpasupplicant_scanresultscallback)(GArray* scanresults);
 
+void network_wpasupplicant_setsingleprocess(gboolean single);
 NetworkWpaSupplicant* network_wpasupplicant_new(const char* interface);
 void network_wpasupplicant_seties(NetworkWpaSupplicant* supplicant,
 		const struct network_wpasupplicant_ie* ies, unsigned numies);
-void network_wpasupplicant_scan(NetworkWpaSupplicant* supplicant);
+gboolean network_wpasupplicant_scan(NetworkWpaSupplicant* supplicant);
 int network_wpasupplicant_addnetwork(NetworkWpaSupplicant* supplicant,
-		const gchar* ssid, const gchar* psk, unsigned mode);
+		const gchar* ssid, const gchar* psk, const guint8* pmk, unsigned mode);
 void network_wpasupplicant_selectnetwork(NetworkWpaSupplicant* supplicant,
 		int which);
-GPtrArray* network_wpasupplicant_getlastscanresults(void);
+void network_wpasupplicant_sethints(NetworkWpaSupplicant* supplicant,
+		int networkid, const gchar* bssid, int frequency);
+void network_wpasupplicant_clearhints(NetworkWpaSupplicant* supplicant,
+		int networkid);
+gboolean network_wpasupplicant_getbss(NetworkWpaSupplicant* supplicant,
+		const gchar** bssid, int* frequency);
+void network_wpasupplicant_getscanresults(NetworkWpaSupplicant* supplicant,
+		network_wpasupplicant_scanresultscallback callback);
 void network_wpasupplicant_dumpstate(NetworkWpaSupplicant* supplicant,
-		JsonBuilder* builder);
+		const gchar* name, struct serialiser* serialiser);
+void network_wpasupplicant_dumpdebug(NetworkWpaSupplicant* supplicant,
+		const gchar* name, struct serialiser* serialiser);
 void network_wpasupplicant_ctrl_fill(NetworkWpaSupplicant* supplicant,
 		struct tbus_fieldandbuff* field);
 void network_wpasupplicant_stop(NetworkWpaSupplicant* supplicant);
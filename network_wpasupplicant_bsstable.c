@@ -0,0 +1,177 @@
+/* The BSSs wpa_supplicant knows about, kept up to date from its
+ * BSS-ADDED and BSS-REMOVED events so that a scan only costs as much as
+ * the BSSs that came and went during it. Each BSS is stored once and
+ * indexed by its bssid.
+ *
+ * wpa_supplicant doesn't say anything when a BSS it already knows about is
+ * seen again and events can be lost if it can't send them, so every now
+ * and then the whole table is checked against what wpa_supplicant has and
+ * the signal levels and ages are brought up to date. Every
+ * BSS that is reported during a resync is marked with the current
+ * generation and anything left with an older one at the end is gone.
+ * BSSs removed while a resync is running are remembered until it's done
+ * so a page that was put together before the removal doesn't bring them
+ * back.
+ */
+
+#include <string.h>
+#include "network_wpasupplicant_bsstable.h"
+
+struct network_wpasupplicant_bss {
+	struct network_scanresult result;
+	// monotonic time in microseconds the bss was last seen by a scan
+	gint64 lastseen;
+	guint generation;
+};
+
+struct network_wpasupplicant_bsstable {
+	// bssid -> struct network_wpasupplicant_bss, the key is in the value
+	GHashTable* bsss;
+	guint generation;
+	// bssids removed during the current resync, NULL if there isn't one
+	GHashTable* removedduringresync;
+};
+
+struct network_wpasupplicant_bsstable* network_wpasupplicant_bsstable_new() {
+	struct network_wpasupplicant_bsstable* table = g_malloc0(sizeof(*table));
+	table->bsss = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			g_free);
+	return table;
+}
+
+void network_wpasupplicant_bsstable_free(
+		struct network_wpasupplicant_bsstable* table) {
+	if (table->removedduringresync != NULL)
+		g_hash_table_unref(table->removedduringresync);
+	g_hash_table_unref(table->bsss);
+	g_free(table);
+}
+
+static void network_wpasupplicant_bsstable_put(
+		struct network_wpasupplicant_bsstable* table,
+		const struct network_scanresult* result, gint64 now) {
+	struct network_wpasupplicant_bss* bss = g_hash_table_lookup(table->bsss,
+			result->bssid);
+	if (bss == NULL) {
+		bss = g_malloc(sizeof(*bss));
+		memcpy(&bss->result, result, sizeof(bss->result));
+		g_hash_table_insert(table->bsss, bss->result.bssid, bss);
+	} else
+		memcpy(&bss->result, result, sizeof(bss->result));
+	bss->lastseen = now - (result->age * 1000);
+	bss->generation = table->generation;
+}
+
+void network_wpasupplicant_bsstable_update(
+		struct network_wpasupplicant_bsstable* table, GArray* scanresults,
+		gint64 now) {
+	for (guint i = 0; i < scanresults->len; i++)
+		network_wpasupplicant_bsstable_put(table,
+				&g_array_index(scanresults, struct network_scanresult, i), now);
+}
+
+void network_wpasupplicant_bsstable_resync(
+		struct network_wpasupplicant_bsstable* table, GArray* scanresults,
+		gint64 now) {
+	for (guint i = 0; i < scanresults->len; i++) {
+		struct network_scanresult* result = &g_array_index(scanresults,
+				struct network_scanresult, i);
+		if (table->removedduringresync != NULL
+				&& g_hash_table_contains(table->removedduringresync,
+						result->bssid))
+			continue;
+		network_wpasupplicant_bsstable_put(table, result, now);
+	}
+}
+
+gboolean network_wpasupplicant_bsstable_remove(
+		struct network_wpasupplicant_bsstable* table, const gchar* bssid) {
+	if (table->removedduringresync != NULL)
+		g_hash_table_add(table->removedduringresync, g_strdup(bssid));
+	return g_hash_table_remove(table->bsss, bssid);
+}
+
+void network_wpasupplicant_bsstable_beginresync(
+		struct network_wpasupplicant_bsstable* table) {
+	table->generation++;
+	if (table->removedduringresync == NULL)
+		table->removedduringresync = g_hash_table_new_full(g_str_hash,
+				g_str_equal, g_free, NULL);
+	else
+		g_hash_table_remove_all(table->removedduringresync);
+}
+
+void network_wpasupplicant_bsstable_abortresync(
+		struct network_wpasupplicant_bsstable* table) {
+	if (table->removedduringresync != NULL) {
+		g_hash_table_unref(table->removedduringresync);
+		table->removedduringresync = NULL;
+	}
+}
+
+static gboolean network_wpasupplicant_bsstable_notresynced(gpointer key,
+		gpointer value, gpointer user_data) {
+	struct network_wpasupplicant_bss* bss = value;
+	guint* generation = user_data;
+	return bss->generation != *generation;
+}
+
+guint network_wpasupplicant_bsstable_endresync(
+		struct network_wpasupplicant_bsstable* table) {
+	network_wpasupplicant_bsstable_abortresync(table);
+	return g_hash_table_foreach_remove(table->bsss,
+			network_wpasupplicant_bsstable_notresynced, &table->generation);
+}
+
+struct network_wpasupplicant_bsstable_cutoff {
+	gint64 now;
+	gint64 maxage;
+};
+
+static gboolean network_wpasupplicant_bsstable_tooold(gpointer key,
+		gpointer value, gpointer user_data) {
+	struct network_wpasupplicant_bss* bss = value;
+	struct network_wpasupplicant_bsstable_cutoff* cutoff = user_data;
+	return cutoff->now - bss->lastseen > cutoff->maxage;
+}
+
+guint network_wpasupplicant_bsstable_expire(
+		struct network_wpasupplicant_bsstable* table, gint64 now,
+		gint64 maxage) {
+	struct network_wpasupplicant_bsstable_cutoff cutoff = { .now = now,
+			.maxage = maxage };
+	return g_hash_table_foreach_remove(table->bsss,
+			network_wpasupplicant_bsstable_tooold, &cutoff);
+}
+
+/* The BSSs that have been seen within maxage, with their ages worked
+ * out for now.
+ */
+GArray* network_wpasupplicant_bsstable_snapshot(
+		struct network_wpasupplicant_bsstable* table, gint64 now,
+		gint64 maxage) {
+	GArray* scanresults = g_array_sized_new(FALSE, FALSE,
+			sizeof(struct network_scanresult),
+			g_hash_table_size(table->bsss));
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, table->bsss);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct network_wpasupplicant_bss* bss = value;
+		gint64 age = now - bss->lastseen;
+		if (age > maxage)
+			continue;
+		g_array_append_val(scanresults, bss->result);
+		struct network_scanresult* result = &g_array_index(scanresults,
+				struct network_scanresult, scanresults->len - 1);
+		result->age = MAX(age, 0) / 1000;
+	}
+
+	return scanresults;
+}
+
+guint network_wpasupplicant_bsstable_size(
+		struct network_wpasupplicant_bsstable* table) {
+	return g_hash_table_size(table->bsss);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glib.h>
+#include "network_model.h"
+
+struct network_wpasupplicant_bsstable;
+
+struct network_wpasupplicant_bsstable* network_wpasupplicant_bsstable_new(void);
+void network_wpasupplicant_bsstable_free(
+		struct network_wpasupplicant_bsstable* table);
+void network_wpasupplicant_bsstable_update(
+		struct network_wpasupplicant_bsstable* table, GArray* scanresults,
+		gint64 now);
+void network_wpasupplicant_bsstable_resync(
+		struct network_wpasupplicant_bsstable* table, GArray* scanresults,
+		gint64 now);
+gboolean network_wpasupplicant_bsstable_remove(
+		struct network_wpasupplicant_bsstable* table, const gchar* bssid);
+void network_wpasupplicant_bsstable_beginresync(
+		struct network_wpasupplicant_bsstable* table);
+void network_wpasupplicant_bsstable_abortresync(
+		struct network_wpasupplicant_bsstable* table);
+guint network_wpasupplicant_bsstable_endresync(
+		struct network_wpasupplicant_bsstable* table);
+guint network_wpasupplicant_bsstable_expire(
+		struct network_wpasupplicant_bsstable* table, gint64 now,
+		gint64 maxage);
+GArray* network_wpasupplicant_bsstable_snapshot(
+		struct network_wpasupplicant_bsstable* table, gint64 now,
+		gint64 maxage);
+guint network_wpasupplicant_bsstable_size(
+		struct network_wpasupplicant_bsstable* table);
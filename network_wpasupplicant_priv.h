@@ -2,21 +2,86 @@
 
 #include "network_wpasupplicant.h"
 
-#define MATCHBSSID "((?:[0-9a-f]{2}:{0,1}){6})"
-#define MATCHFREQ "([1-9]{4})"
-#define MATCHRSSI "(-[1-9]{2,3})"
-#define FLAGPATTERN "[A-Z2\\-\\+]*"
-#define MATCHFLAG "\\[("FLAGPATTERN")\\]"
-#define MATCHFLAGS "((?:\\["FLAGPATTERN"\\]){1,})"
-#define MATCHSSID "([a-zA-Z0-9\\-]*)"
-#define SCANRESULTREGEX MATCHBSSID"\\s*"MATCHFREQ"\\s*"MATCHRSSI"\\s*"MATCHFLAGS"\\s*"MATCHSSID
-
 #define NETWORK_WPASUPPLICANT_REGEX_KEYVALUE "([a-z]{1,})=(([0-9]{1,}|[A-Z,_]{1,}|\".*\"))"
 
+#define WPASUPPLICANT_BUFFER_INITIAL	1024
+// replies and events bigger than this are dropped
+#define WPASUPPLICANT_BUFFER_MAX		(256 * 1024)
+
+struct network_wpasupplicant_buffer {
+	gchar* data;
+	gsize size;
+};
+
+// how long to wait for the control socket to appear in seconds
+#define WPASUPPLICANT_STARTUP_TIMEOUT	10
+// connection retry backoff in milliseconds
+#define WPASUPPLICANT_CONNECT_FIRSTDELAY	10
+#define WPASUPPLICANT_CONNECT_MAXDELAY		250
+
+// how long to wait for a reply to a command in seconds
+#define WPASUPPLICANT_COMMAND_TIMEOUT	10
+
+// how often the bss table is checked against wpa_supplicant in seconds
+#define WPASUPPLICANT_BSS_RESYNC	60
+// bsss that haven't been seen in a scan for this long are dropped, seconds
+#define WPASUPPLICANT_BSS_MAXAGE	300
+#define WPASUPPLICANT_BSS_MASK	(WPA_BSS_MASK_ID | WPA_BSS_MASK_BSSID\
+	| WPA_BSS_MASK_FREQ | WPA_BSS_MASK_LEVEL | WPA_BSS_MASK_AGE\
+	| WPA_BSS_MASK_IE | WPA_BSS_MASK_FLAGS | WPA_BSS_MASK_SSID)
+
+typedef void (*network_wpasupplicant_commandcallback)(
+		NetworkWpaSupplicant* supplicant, const gchar* command,
+		const gchar* reply, gsize replylen, gpointer user_data);
+
+struct network_wpasupplicant_command {
+	const gchar* command;
+	gboolean stripnewline;
+	network_wpasupplicant_commandcallback callback;
+	gpointer user_data;
+};
+
 typedef void (*wpaeventhandler)(NetworkWpaSupplicant* supplicant,
 		const gchar* event);
 
+/* events are matched on the prefix after the level, command includes the
+ * trailing space so the length is worked out when the table is built.
+ */
 struct wpaeventhandler_entry {
 	const gchar* command;
+	gsize commandlen;
+	// what the handler is called in the status
+	const gchar* name;
 	const wpaeventhandler handler;
 };
+
+#define WPAEVENTHANDLER(c, n, h) { .command = c, .commandlen = sizeof(c) - 1,\
+	.name = n, .handler = h }
+
+#define WPASUPPLICANT_MAXEVENTHANDLERS	16
+// events handled per wakeup before going back to the main loop
+#define WPASUPPLICANT_EVENT_BATCH		64
+
+/* a network that has been added, what it's set up with is held until the
+ * supplicant has said which id it has.
+ */
+struct network_wpasupplicant_network {
+	// the handle addnetwork returned and the supplicant's id, -1 until known
+	int handle;
+	int id;
+	// the supplicant refused the ADD_NETWORK
+	gboolean failed;
+	gchar* ssid;
+	// either quoted or the pmk in hex, ready to go into SET_NETWORK
+	gchar* psk;
+	unsigned mode;
+	gboolean selected;
+	char hintbssid[18];
+	int hintfrequency;
+};
+
+struct network_wpasupplicant_eventstats {
+	guint64 count;
+	// microseconds spent in the handler
+	gint64 time;
+};
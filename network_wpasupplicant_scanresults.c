@@ -0,0 +1,264 @@
+/* Parser for the reply to BSS. With a mask that asks for everything we
+ * use the reply is a block of key=value lines per BSS, each starting with
+ * the id:
+ *
+ * id=3
+ * bssid=02:00:00:00:00:01
+ * freq=2412
+ * level=-38
+ * age=2
+ * ie=0004746573740112...
+ * flags=[WPA2-PSK-CCMP][ESS]
+ * ssid=thingy-home
+ *
+ * BSS RANGE= replies are just the blocks for each BSS one after the other.
+ * The reply is walked once and each BSS is written straight into the next
+ * slot of the result array.
+ */
+
+#include <string.h>
+#include "network_wpasupplicant_scanresults.h"
+
+#define KEY_ID		"id"
+#define KEY_BSSID	"bssid"
+#define KEY_FREQ	"freq"
+#define KEY_LEVEL	"level"
+#define KEY_AGE		"age"
+#define KEY_IE		"ie"
+#define KEY_FLAGS	"flags"
+#define KEY_SSID	"ssid"
+
+#define KEYIS(k, len, key) ((len) == sizeof(key) - 1 && memcmp(k, key, len) == 0)
+
+#define IE_VENDOR	221
+
+// bssids are always formatted as xx:xx:xx:xx:xx:xx
+#define BSSIDLEN 17
+
+static const struct {
+	const gchar* flag;
+	unsigned value;
+} flagtable[] = { { FLAG_ESS, NF_ESS }, //
+		{ FLAG_WPS, NF_WPS }, //
+		{ FLAG_WEP, NF_WEP }, //
+		{ FLAG_WPA_PSK_CCMP, NF_WPA_PSK_CCMP }, //
+		{ FLAG_WPA_PSK_CCMP_TKIP, NF_WPA_PSK_CCMP_TKIP }, //
+		{ FLAG_WPA2_PSK_CCMP, NF_WPA2_PSK_CCMP }, //
+		{ FLAG_WPA2_PSK_CCMP_TKIP, NF_WPA2_PSK_CCMP_TKIP } };
+
+static const gchar thingyidstr[] = NETWORK_THINGYIE;
+
+static gboolean network_wpasupplicant_scanresults_parseint(const gchar* start,
+		const gchar* end, int* value) {
+	gboolean negative = FALSE;
+	int v = 0;
+	if (start < end && *start == '-') {
+		negative = TRUE;
+		start++;
+	}
+	if (start == end)
+		return FALSE;
+	for (; start < end; start++) {
+		if (!g_ascii_isdigit(*start) || v > (G_MAXINT / 10) - 1)
+			return FALSE;
+		v = (v * 10) + (*start - '0');
+	}
+	*value = negative ? -v : v;
+	return TRUE;
+}
+
+/* flags are a run of [FLAG] with no separators, flags we don't know
+ * about are skipped.
+ */
+static unsigned network_wpasupplicant_scanresults_parseflags(
+		const gchar* start, const gchar* end) {
+	unsigned flags = 0;
+	while (start < end) {
+		if (*start != '[')
+			break;
+		const gchar* flag = start + 1;
+		const gchar* close = memchr(flag, ']', end - flag);
+		if (close == NULL)
+			break;
+		gsize flaglen = close - flag;
+		for (int i = 0; i < G_N_ELEMENTS(flagtable); i++) {
+			if (strlen(flagtable[i].flag) == flaglen
+					&& memcmp(flagtable[i].flag, flag, flaglen) == 0) {
+				flags |= flagtable[i].value;
+				break;
+			}
+		}
+		start = close + 1;
+	}
+	return flags;
+}
+
+/* wpa_supplicant escapes ssids with printf_encode(), backslash and quote
+ * are escaped, \e, \n, \r and \t are used for those characters and any
+ * other byte outside of printable ascii is sent as \xHH. This undoes that
+ * so the ssid is the raw bytes the AP sent, which will usually be UTF-8.
+ */
+static gboolean network_wpasupplicant_scanresults_parsessid(
+		const gchar* start, const gchar* end, char* ssid) {
+	gsize len = 0;
+	while (start < end) {
+		char c = *start++;
+		if (c == '\\') {
+			if (start == end)
+				return FALSE;
+			c = *start++;
+			switch (c) {
+			case '\\':
+			case '"':
+				break;
+			case 'e':
+				c = '\033';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'x': {
+				if (end - start < 2 || !g_ascii_isxdigit(start[0])
+						|| !g_ascii_isxdigit(start[1]))
+					return FALSE;
+				c = (g_ascii_xdigit_value(start[0]) << 4)
+						| g_ascii_xdigit_value(start[1]);
+				start += 2;
+			}
+				break;
+			default:
+				return FALSE;
+			}
+		}
+		if (len == NETWORK_SSIDSTORAGELEN - 1)
+			return FALSE;
+		ssid[len++] = c;
+	}
+	ssid[len] = '\0';
+	return TRUE;
+}
+
+static int network_wpasupplicant_scanresults_hexbyte(const gchar* hex) {
+	int high = g_ascii_xdigit_value(hex[0]);
+	int low = g_ascii_xdigit_value(hex[1]);
+	if (high < 0 || low < 0)
+		return -1;
+	return (high << 4) | low;
+}
+
+/* The IEs are sent as one long hex string. They are walked in place
+ * looking for the vendor IE that thingymcconfig APs add to their beacons.
+ */
+static gboolean network_wpasupplicant_scanresults_hasthingyie(
+		const gchar* start, const gchar* end) {
+	while (end - start >= 4) {
+		int id = network_wpasupplicant_scanresults_hexbyte(start);
+		int len = network_wpasupplicant_scanresults_hexbyte(start + 2);
+		const gchar* payload = start + 4;
+		if (id < 0 || len < 0 || end - payload < len * 2)
+			break;
+		if (id == IE_VENDOR && len >= sizeof(thingyidstr) - 1) {
+			gboolean match = TRUE;
+			for (int i = 0; i < sizeof(thingyidstr) - 1 && match; i++)
+				match = network_wpasupplicant_scanresults_hexbyte(
+						payload + (i * 2)) == (guint8) thingyidstr[i];
+			if (match)
+				return TRUE;
+		}
+		start = payload + (len * 2);
+	}
+	return FALSE;
+}
+
+GArray* network_wpasupplicant_scanresults_parsebss(const gchar* reply,
+		gsize replylen, int* lastid) {
+	const gchar* end = reply + replylen;
+
+	GArray* scanresults = g_array_new(FALSE, TRUE,
+			sizeof(struct network_scanresult));
+	struct network_scanresult* scanresult = NULL;
+	// a BSS is only kept if it has a bssid and everything else made sense
+	gboolean havebssid = FALSE, bad = FALSE;
+#define KEEP (havebssid && !bad)
+
+	const gchar* line = reply;
+	while (line < end) {
+		const gchar* lineend = memchr(line, '\n', end - line);
+		if (lineend == NULL)
+			lineend = end;
+		const gchar* value = memchr(line, '=', lineend - line);
+		if (value == NULL)
+			goto next;
+		gsize keylen = value++ - line;
+
+		if (KEYIS(line, keylen, KEY_ID)) {
+			if (scanresult != NULL && !KEEP)
+				g_array_set_size(scanresults, scanresults->len - 1);
+			g_array_set_size(scanresults, scanresults->len + 1);
+			scanresult = &g_array_index(scanresults, struct network_scanresult,
+					scanresults->len - 1);
+			havebssid = FALSE;
+			bad = FALSE;
+			int id;
+			if (lastid != NULL
+					&& network_wpasupplicant_scanresults_parseint(value,
+							lineend, &id))
+				*lastid = id;
+		}
+		// anything before the first id isn't part of a BSS
+		else if (scanresult == NULL)
+			goto next;
+		else if (KEYIS(line, keylen, KEY_BSSID)) {
+			if (lineend - value != BSSIDLEN)
+				goto bad;
+			memcpy(scanresult->bssid, value, BSSIDLEN);
+			scanresult->bssid[BSSIDLEN] = '\0';
+			havebssid = TRUE;
+		} else if (KEYIS(line, keylen, KEY_FREQ)) {
+			if (!network_wpasupplicant_scanresults_parseint(value, lineend,
+					&scanresult->frequency))
+				goto bad;
+		} else if (KEYIS(line, keylen, KEY_LEVEL)) {
+			if (!network_wpasupplicant_scanresults_parseint(value, lineend,
+					&scanresult->rssi))
+				goto bad;
+		} else if (KEYIS(line, keylen, KEY_AGE)) {
+			// seconds since the BSS was last seen
+			int age;
+			if (!network_wpasupplicant_scanresults_parseint(value, lineend,
+					&age) || age < 0)
+				goto bad;
+			scanresult->age = age * 1000;
+		} else if (KEYIS(line, keylen, KEY_IE)) {
+			if (network_wpasupplicant_scanresults_hasthingyie(value, lineend))
+				scanresult->flags |= NF_THINGY;
+		} else if (KEYIS(line, keylen, KEY_FLAGS))
+			scanresult->flags |= network_wpasupplicant_scanresults_parseflags(
+					value, lineend);
+		else if (KEYIS(line, keylen, KEY_SSID)) {
+			if (!network_wpasupplicant_scanresults_parsessid(value, lineend,
+					scanresult->ssid))
+				goto bad;
+		}
+		goto next;
+
+		bad: //
+		g_message("couldn't parse bss line: %.*s", (int) (lineend - line),
+				line);
+		bad = TRUE;
+		next: //
+		line = lineend + 1;
+	}
+
+	if (scanresult != NULL && !KEEP)
+		g_array_set_size(scanresults, scanresults->len - 1);
+#undef KEEP
+
+	return scanresults;
+}
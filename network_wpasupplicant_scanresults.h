@@ -0,0 +1,15 @@
+#pragma once
+
+#include <glib.h>
+#include "network_model.h"
+
+#define FLAG_ESS "ESS"
+#define FLAG_WPS "WPS"
+#define FLAG_WEP "WEP"
+#define FLAG_WPA_PSK_CCMP "WPA-PSK-CCMP"
+#define FLAG_WPA_PSK_CCMP_TKIP "WPA-PSK-CCMP+TKIP"
+#define FLAG_WPA2_PSK_CCMP "WPA2-PSK-CCMP"
+#define FLAG_WPA2_PSK_CCMP_TKIP "WPA2-PSK-CCMP+TKIP"
+
+GArray* network_wpasupplicant_scanresults_parsebss(const gchar* reply,
+		gsize replylen, int* lastid);
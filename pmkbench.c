@@ -0,0 +1,57 @@
+/* Microbenchmark for the PMK derivation. Associating with a passphrase
+ * means wpa_supplicant has to run the 4096 iteration PBKDF2 before it can
+ * start the handshake, with the stored PMK it only has to parse the hex.
+ * Both are timed here to show what is taken off every association, the
+ * derivation is checked against the IEEE 802.11i test vectors first.
+ *
+ * This is only the part of the time to associate that storing the PMK
+ * changes, the whole of it needs a radio and an AP so it's reported by the
+ * supplicant itself as associate_ms in the status.
+ */
+
+#include <string.h>
+#include "network_pmk.h"
+
+#define ITERATIONS 20
+#define HEXITERATIONS 100000
+
+static const struct {
+	const gchar* passphrase;
+	const gchar* ssid;
+	const gchar* pmk;
+} vectors[] = { { "password", "IEEE",
+		"f42c6fc52df0ebef9ebb4b90b38a5f902e83fe1b135a70e23aed762e9710a12e" },
+		{ "ThisIsAPassword", "ThisIsASSID",
+				"0dc0d6eb90555ed6419756b9a15ec3e3209b63df707dd508d14581f8982721af" } };
+
+int main(int argc, char** argv) {
+	guint8 pmk[NETWORK_PMKLEN];
+	gchar pmkhex[(NETWORK_PMKLEN * 2) + 1];
+
+	for (int i = 0; i < G_N_ELEMENTS(vectors); i++) {
+		network_pmk_derive(vectors[i].passphrase, vectors[i].ssid, pmk);
+		network_pmk_tohex(pmk, pmkhex);
+		if (strcmp(pmkhex, vectors[i].pmk) != 0) {
+			g_print("wrong pmk for %s/%s: %s\n", vectors[i].passphrase,
+					vectors[i].ssid, pmkhex);
+			return 1;
+		}
+	}
+
+	gint64 start = g_get_monotonic_time();
+	for (int i = 0; i < ITERATIONS; i++)
+		network_pmk_derive("reallysecurepassword", "thingy-home", pmk);
+	gint64 derive = g_get_monotonic_time() - start;
+
+	network_pmk_tohex(pmk, pmkhex);
+	start = g_get_monotonic_time();
+	for (int i = 0; i < HEXITERATIONS; i++)
+		network_pmk_fromhex(pmkhex, pmk);
+	gint64 fromhex = g_get_monotonic_time() - start;
+
+	g_print("passphrase: %.2f ms per association\n",
+			(derive / 1000.0) / ITERATIONS);
+	g_print("stored pmk: %.2f us per association\n",
+			(gdouble) fromhex / HEXITERATIONS);
+	return 0;
+}
@@ -0,0 +1,68 @@
+/* Microbenchmark for the BSS reply parser. A BSS RANGE=ALL reply with 200
+ * BSSs, in the shape of a capture from a busy office, is generated and
+ * parsed over and over to get the time per reply and per BSS.
+ */
+
+#include <glib.h>
+#include "network_wpasupplicant_scanresults.h"
+
+#define NUMBSS 200
+#define ITERATIONS 20000
+
+static const gchar* ssids[] = { "thingy-home", "thingy-office", "eduroam",
+		"cafe guest", "caf\\xc3\\xa9", "\\xe3\\x83\\x86\\xe3\\x82\\xb9\\xe3\\x83\\x88",
+		"printer \\\"2nd floor\\\"", "back\\\\slash", "", "DIRECT-xy-HP OfficeJet" };
+
+static const gchar* flags[] = { "[WPA2-PSK-CCMP][ESS]",
+		"[WPA-PSK-CCMP+TKIP][WPA2-PSK-CCMP+TKIP][ESS]",
+		"[WPA2-EAP-CCMP][ESS]", "[ESS]", "[WPA2-PSK-CCMP][WPS][ESS][P2P]",
+		"[WEP][ESS]" };
+
+static const int frequencies[] = { 2412, 2437, 2462, 5180, 5240, 5500, 5745 };
+
+// supported rates, ds parameter set and then the thingymcconfig vendor ie
+static const gchar* ies[] = { "010882848b960c12182403010b",
+		"010882848b960c12182403010b"
+				"dd107468696e67796d63636f6e6669673a30" };
+
+static GString* scanresultsbench_makereply(void) {
+	GString* reply = g_string_new(NULL);
+	for (int i = 0; i < NUMBSS; i++) {
+		g_string_append_printf(reply,
+				"id=%d\nbssid=02:00:00:%02x:%02x:%02x\nfreq=%d\nlevel=%d\n"
+						"age=%d\nie=%s\nflags=%s\nssid=%s\n", i, i / 100,
+				i % 100, i, frequencies[i % G_N_ELEMENTS(frequencies)],
+				-30 - (i % 60), i % 5, ies[i % G_N_ELEMENTS(ies)],
+				flags[i % G_N_ELEMENTS(flags)],
+				ssids[i % G_N_ELEMENTS(ssids)]);
+	}
+	return reply;
+}
+
+int main(int argc, char** argv) {
+	GString* reply = scanresultsbench_makereply();
+
+	int lastid = -1;
+	GArray* scanresults = network_wpasupplicant_scanresults_parsebss(
+			reply->str, reply->len, &lastid);
+	if (scanresults->len != NUMBSS || lastid != NUMBSS - 1) {
+		g_print("expected %d results, got %u\n", NUMBSS, scanresults->len);
+		return 1;
+	}
+	g_array_unref(scanresults);
+
+	gint64 start = g_get_monotonic_time();
+	for (int i = 0; i < ITERATIONS; i++) {
+		scanresults = network_wpasupplicant_scanresults_parsebss(reply->str,
+				reply->len, NULL);
+		g_array_unref(scanresults);
+	}
+	gint64 elapsed = g_get_monotonic_time() - start;
+
+	gdouble perreply = (elapsed * 1000.0) / ITERATIONS;
+	g_print("%d BSS reply (%"G_GSIZE_FORMAT" bytes), %.0f ns per reply, "
+	"%.1f ns per BSS\n", NUMBSS, reply->len, perreply, perreply / NUMBSS);
+
+	g_string_free(reply, TRUE);
+	return 0;
+}
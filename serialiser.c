@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include "serialiser.h"
+#include "cbor.h"
+
+#define ISJSON(s) (s->format == SERIALISER_FORMAT_JSON)
+#define APPENDCHAR(s, c) do {\
+		guint8 ch = c;\
+		g_byte_array_append(s->buf, &ch, 1);\
+	} while (0)
+#define APPENDSTR(s, str) g_byte_array_append(s->buf, (const guint8*) str,\
+		strlen(str))
+
+void serialiser_init(struct serialiser* serialiser, GByteArray* buf,
+		enum serialiser_format format) {
+	g_byte_array_set_size(buf, 0);
+	serialiser->format = format;
+	serialiser->buf = buf;
+	serialiser->depth = 0;
+	serialiser->notempty = 0;
+	serialiser->aftermember = FALSE;
+}
+
+/* json needs a comma before everything in a container apart from the
+ * first thing and values that follow a member name.
+ */
+static void serialiser_json_separate(struct serialiser* serialiser) {
+	if (serialiser->aftermember) {
+		serialiser->aftermember = FALSE;
+		return;
+	}
+	guint32 bit = 1u << serialiser->depth;
+	if (serialiser->notempty & bit)
+		APPENDCHAR(serialiser, ',');
+	serialiser->notempty |= bit;
+}
+
+static void serialiser_begincontainer(struct serialiser* serialiser,
+		char open) {
+	g_assert(serialiser->depth + 1 < SERIALISER_MAXDEPTH);
+	if (ISJSON(serialiser)) {
+		serialiser_json_separate(serialiser);
+		APPENDCHAR(serialiser, open);
+	} else if (open == '{')
+		cbor_writeindefinitemap(serialiser->buf);
+	else
+		cbor_writeindefinitearray(serialiser->buf);
+	serialiser->depth++;
+	serialiser->notempty &= ~(1u << serialiser->depth);
+}
+
+static void serialiser_endcontainer(struct serialiser* serialiser,
+		char close) {
+	g_assert(serialiser->depth > 0);
+	serialiser->depth--;
+	if (ISJSON(serialiser))
+		APPENDCHAR(serialiser, close);
+	else
+		cbor_writebreak(serialiser->buf);
+}
+
+void serialiser_beginobject(struct serialiser* serialiser) {
+	serialiser_begincontainer(serialiser, '{');
+}
+
+void serialiser_endobject(struct serialiser* serialiser) {
+	serialiser_endcontainer(serialiser, '}');
+}
+
+void serialiser_beginarray(struct serialiser* serialiser) {
+	serialiser_begincontainer(serialiser, '[');
+}
+
+void serialiser_endarray(struct serialiser* serialiser) {
+	serialiser_endcontainer(serialiser, ']');
+}
+
+static void serialiser_json_escapechar(struct serialiser* serialiser,
+		guchar c) {
+	gchar escaped[7];
+	switch (c) {
+	case '"':
+		APPENDSTR(serialiser, "\\\"");
+		break;
+	case '\\':
+		APPENDSTR(serialiser, "\\\\");
+		break;
+	case '\n':
+		APPENDSTR(serialiser, "\\n");
+		break;
+	case '\r':
+		APPENDSTR(serialiser, "\\r");
+		break;
+	case '\t':
+		APPENDSTR(serialiser, "\\t");
+		break;
+	default:
+		g_snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned) c);
+		APPENDSTR(serialiser, escaped);
+		break;
+	}
+}
+
+#define REPLACEMENTCHAR "\xef\xbf\xbd"
+
+/* Strings are copied across in runs of characters that don't need
+ * escaping. Anything that isn't valid UTF-8, an ssid from a scan for
+ * example, is replaced with U+FFFD so the output is always valid.
+ */
+static void serialiser_json_string(struct serialiser* serialiser,
+		const gchar* value) {
+	APPENDCHAR(serialiser, '"');
+	const gchar* end = value + strlen(value);
+	while (value < end) {
+		const gchar* validend;
+		g_utf8_validate(value, end - value, &validend);
+		const gchar* run = value;
+		for (; value < validend; value++) {
+			guchar c = *value;
+			if (c == '"' || c == '\\' || c < 0x20) {
+				g_byte_array_append(serialiser->buf, (const guint8*) run,
+						value - run);
+				serialiser_json_escapechar(serialiser, c);
+				run = value + 1;
+			}
+		}
+		g_byte_array_append(serialiser->buf, (const guint8*) run, value - run);
+		if (value < end) {
+			APPENDSTR(serialiser, REPLACEMENTCHAR);
+			value++;
+		}
+	}
+	APPENDCHAR(serialiser, '"');
+}
+
+static void serialiser_cbor_string(struct serialiser* serialiser,
+		const gchar* value) {
+	gsize len = strlen(value);
+	if (g_utf8_validate(value, len, NULL))
+		cbor_writetext(serialiser->buf, value, len);
+	else {
+		// rare enough that making a fixed up copy doesn't matter
+		gchar* valid = g_utf8_make_valid(value, len);
+		cbor_writetext(serialiser->buf, valid, strlen(valid));
+		g_free(valid);
+	}
+}
+
+void serialiser_member(struct serialiser* serialiser, const gchar* name) {
+	if (ISJSON(serialiser)) {
+		serialiser_json_separate(serialiser);
+		serialiser_json_string(serialiser, name);
+		APPENDCHAR(serialiser, ':');
+		serialiser->aftermember = TRUE;
+	} else
+		serialiser_cbor_string(serialiser, name);
+}
+
+void serialiser_string(struct serialiser* serialiser, const gchar* value) {
+	if (ISJSON(serialiser)) {
+		serialiser_json_separate(serialiser);
+		serialiser_json_string(serialiser, value);
+	} else
+		serialiser_cbor_string(serialiser, value);
+}
+
+void serialiser_int(struct serialiser* serialiser, gint64 value) {
+	if (ISJSON(serialiser)) {
+		gchar str[24];
+		serialiser_json_separate(serialiser);
+		g_snprintf(str, sizeof(str), "%"G_GINT64_FORMAT, value);
+		APPENDSTR(serialiser, str);
+	} else
+		cbor_writeint(serialiser->buf, value);
+}
+
+void serialiser_bool(struct serialiser* serialiser, gboolean value) {
+	if (ISJSON(serialiser)) {
+		serialiser_json_separate(serialiser);
+		APPENDSTR(serialiser, value ? "true" : "false");
+	} else
+		cbor_writebool(serialiser->buf, value);
+}
+
+void serialiser_null(struct serialiser* serialiser) {
+	if (ISJSON(serialiser)) {
+		serialiser_json_separate(serialiser);
+		APPENDSTR(serialiser, "null");
+	} else
+		cbor_writenull(serialiser->buf);
+}
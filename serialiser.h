@@ -0,0 +1,61 @@
+#pragma once
+
+#include <glib.h>
+
+/* Streaming writer for status dumps and the like. Values are appended
+ * straight into a byte array, which can be reused between dumps, as
+ * either JSON or CBOR with the same nesting rules as JsonBuilder.
+ */
+
+enum serialiser_format {
+	SERIALISER_FORMAT_JSON, SERIALISER_FORMAT_CBOR
+};
+
+// more than enough for anything we dump
+#define SERIALISER_MAXDEPTH 32
+
+struct serialiser {
+	enum serialiser_format format;
+	GByteArray* buf;
+	guint depth;
+	// json only, tracks which containers already have something in them
+	guint32 notempty;
+	gboolean aftermember;
+};
+
+void serialiser_init(struct serialiser* serialiser, GByteArray* buf,
+		enum serialiser_format format);
+void serialiser_beginobject(struct serialiser* serialiser);
+void serialiser_endobject(struct serialiser* serialiser);
+void serialiser_beginarray(struct serialiser* serialiser);
+void serialiser_endarray(struct serialiser* serialiser);
+void serialiser_member(struct serialiser* serialiser, const gchar* name);
+void serialiser_string(struct serialiser* serialiser, const gchar* value);
+void serialiser_int(struct serialiser* serialiser, gint64 value);
+void serialiser_bool(struct serialiser* serialiser, gboolean value);
+void serialiser_null(struct serialiser* serialiser);
+
+#define SERIALISER_START_OBJECT(s, name) do {\
+		serialiser_member(s, name);\
+		serialiser_beginobject(s);\
+	} while (0)
+
+#define SERIALISER_START_ARRAY(s, name) do {\
+		serialiser_member(s, name);\
+		serialiser_beginarray(s);\
+	} while (0)
+
+#define SERIALISER_ADD_STRING(s, name, value) do {\
+		serialiser_member(s, name);\
+		serialiser_string(s, value);\
+	} while (0)
+
+#define SERIALISER_ADD_INT(s, name, value) do {\
+		serialiser_member(s, name);\
+		serialiser_int(s, value);\
+	} while (0)
+
+#define SERIALISER_ADD_BOOL(s, name, value) do {\
+		serialiser_member(s, name);\
+		serialiser_bool(s, value);\
+	} while (0)
@@ -9,6 +9,7 @@
 #include "http.h"
 #include "apps.h"
 #include "args.h"
+#include "certs.h"
 
 static GMainLoop* mainloop;
 
@@ -24,10 +25,13 @@ int main(int argc, char** argv) {
 	gchar* interface = NULL;
 	gchar** apps = NULL;
 	gboolean waitforinterface = FALSE;
+	gint scaninterval = 10;
 	gboolean nonetwork = FALSE;
 	gboolean noap = FALSE;
+	gboolean singlesupplicant = FALSE;
 	gchar* cert = NULL;
 	gchar* key = NULL;
+	struct certs certs = { 0 };
 	int ret = 0;
 
 	gchar* arg_config = NULL;
@@ -35,8 +39,8 @@ int main(int argc, char** argv) {
 
 	GError* error = NULL;
 	GOptionEntry entries[] = {
-	ARGS_NAMEPREFIX, ARGS_INTERFACE, ARGS_WAITFORINTERFACE, ARGS_APP, ARGS_CERT,
-	ARGS_KEY, ARGS_CONFIG, ARGS_LOGFILE,
+	ARGS_NAMEPREFIX, ARGS_INTERFACE, ARGS_WAITFORINTERFACE, ARGS_SCANINTERVAL,
+			ARGS_SINGLESUPPLICANT, ARGS_APP, ARGS_CERT, ARGS_KEY, ARGS_CONFIG, ARGS_LOGFILE,
 #ifdef DEVELOPMENT
 			{ "nonetwork", 0, 0, G_OPTION_ARG_NONE, &nonetwork,
 					"no networking, for local testing", NULL }, { "noap", 0, 0,
@@ -72,6 +76,17 @@ int main(int argc, char** argv) {
 	}
 #endif
 
+	if ((cert == NULL) != (key == NULL)) {
+		g_message("device certificate and private key must both be specified");
+		ret = 1;
+		goto err_args;
+	}
+
+	if (cert != NULL && !certs_load(&certs, cert, key)) {
+		ret = 1;
+		goto err_args;
+	}
+
 	mainloop = g_main_loop_new(NULL, FALSE);
 
 	logging_init(arg_logfile);
@@ -80,7 +95,7 @@ int main(int argc, char** argv) {
 	apps_init((const gchar**) apps);
 
 	if (!nonetwork) {
-		network_init(interface, noap);
+		network_init(interface, noap, MAX(scaninterval, 0), singlesupplicant);
 
 		if (waitforinterface && network_waitforinterface()) {
 			ret = 1;
@@ -94,8 +109,12 @@ int main(int argc, char** argv) {
 		}
 
 	}
+#ifdef DEVELOPMENT
+	else
+		network_init_stub(MAX(scaninterval, 0));
+#endif
 
-	if (http_start()) {
+	if (http_start(certs.cert != NULL ? &certs : NULL)) {
 		g_message("failed to start http");
 		ret = 1;
 		goto err_http_start;
@@ -120,6 +139,7 @@ int main(int argc, char** argv) {
 		network_stop();
 	err_network_waitforinterface: //
 	err_network_start: //
+	certs_free(&certs);
 	err_args: //
 	return ret;
 }